@@ -0,0 +1,215 @@
+/*
+ * A52 Output Plugin - IEC958 burst framing
+ *
+ * Writes the preamble, byte-swaps the payload and zero-fills the rest of
+ * the burst in a single pass, instead of swab() followed by memset().
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "a52_iec958.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_FRAME
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* 16 bytes of 0xff followed by 16 zeros; reading 16 bytes at
+ * 16 - n gives a mask keeping the first n bytes
+ */
+static const unsigned char keep_mask[32] __attribute__((aligned(16))) = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/* the preamble, Pa Pb Pc Pd in big-endian order as before swapping */
+static void write_preamble(unsigned char *burst, unsigned int payload)
+{
+	burst[0] = 0xf8; /* sync words */
+	burst[1] = 0x72;
+	burst[2] = 0x4e;
+	burst[3] = 0x1f;
+	burst[4] = burst[13] & 7; /* bsmod */
+	burst[5] = 0x01; /* data type */
+	burst[6] = ((payload * 8) >> 8) & 0xff;
+	burst[7] = (payload * 8) & 0xff;
+}
+
+void a52_iec958_frame_c(unsigned char *burst, unsigned int payload,
+			unsigned int size, int swap)
+{
+	unsigned int i, end;
+
+	if (payload > size - 8)
+		payload = size - 8;
+	write_preamble(burst, payload);
+	end = 8 + payload;
+	/* an odd payload is padded with a zero before swapping */
+	if (end & 1)
+		burst[end++] = 0;
+
+	/* a word at a time; memcpy keeps the accesses alignment-safe */
+	if (end & 2) {
+		burst[end++] = 0;
+		burst[end++] = 0;
+	}
+	if (swap) {
+		for (i = 0; i < end; i += 4) {
+			uint32_t w;
+			memcpy(&w, burst + i, 4);
+			w = ((w & 0x00ff00ff) << 8) | ((w >> 8) & 0x00ff00ff);
+			memcpy(burst + i, &w, 4);
+		}
+	}
+	memset(burst + end, 0, size - end);
+}
+
+#if defined(__SSE2__)
+static inline __m128i swap16_sse2(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void a52_iec958_frame_sse2(unsigned char *burst, unsigned int payload,
+				  unsigned int size, int swap)
+{
+	unsigned int i, end;
+	__m128i v;
+
+	if (payload > size - 8)
+		payload = size - 8;
+	write_preamble(burst, payload);
+	end = 8 + payload;
+
+	for (i = 0; i + 16 <= end; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(burst + i));
+		if (swap)
+			v = swap16_sse2(v);
+		_mm_storeu_si128((__m128i *)(burst + i), v);
+	}
+	if (i < end) {
+		/* the block with the end of the payload: mask, then swap */
+		v = _mm_loadu_si128((const __m128i *)(burst + i));
+		v = _mm_and_si128(v, _mm_loadu_si128((const __m128i *)
+						     (keep_mask + 16 - (end - i))));
+		if (swap)
+			v = swap16_sse2(v);
+		_mm_storeu_si128((__m128i *)(burst + i), v);
+		i += 16;
+	}
+	v = _mm_setzero_si128();
+	for (; i < size; i += 16)
+		_mm_storeu_si128((__m128i *)(burst + i), v);
+}
+#endif
+
+#ifdef HAVE_AVX2_FRAME
+__attribute__((target("avx2")))
+static void a52_iec958_frame_avx2(unsigned char *burst, unsigned int payload,
+				  unsigned int size, int swap)
+{
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14,
+					      1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14);
+	unsigned int i, end;
+	__m256i v;
+	__m128i h;
+
+	if (payload > size - 8)
+		payload = size - 8;
+	write_preamble(burst, payload);
+	end = 8 + payload;
+
+	for (i = 0; i + 32 <= end; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(burst + i));
+		if (swap)
+			v = _mm256_shuffle_epi8(v, shuf);
+		_mm256_storeu_si256((__m256i *)(burst + i), v);
+	}
+	/* up to 31 payload bytes are left, do them in 16-byte halves */
+	for (; i < end; i += 16) {
+		h = _mm_loadu_si128((const __m128i *)(burst + i));
+		if (end - i < 16)
+			h = _mm_and_si128(h, _mm_loadu_si128((const __m128i *)
+							     (keep_mask + 16 - (end - i))));
+		if (swap)
+			h = _mm_shuffle_epi8(h, _mm256_castsi256_si128(shuf));
+		_mm_storeu_si128((__m128i *)(burst + i), h);
+	}
+	if (i & 16) {
+		_mm_storeu_si128((__m128i *)(burst + i), _mm_setzero_si128());
+		i += 16;
+	}
+	v = _mm256_setzero_si256();
+	for (; i < size; i += 32)
+		_mm256_storeu_si256((__m256i *)(burst + i), v);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void a52_iec958_frame_neon(unsigned char *burst, unsigned int payload,
+				  unsigned int size, int swap)
+{
+	unsigned int i, end;
+	uint8x16_t v;
+
+	if (payload > size - 8)
+		payload = size - 8;
+	write_preamble(burst, payload);
+	end = 8 + payload;
+
+	for (i = 0; i + 16 <= end; i += 16) {
+		v = vld1q_u8(burst + i);
+		if (swap)
+			v = vrev16q_u8(v);
+		vst1q_u8(burst + i, v);
+	}
+	if (i < end) {
+		v = vandq_u8(vld1q_u8(burst + i),
+			     vld1q_u8(keep_mask + 16 - (end - i)));
+		if (swap)
+			v = vrev16q_u8(v);
+		vst1q_u8(burst + i, v);
+		i += 16;
+	}
+	v = vdupq_n_u8(0);
+	for (; i < size; i += 16)
+		vst1q_u8(burst + i, v);
+}
+#endif
+
+a52_iec958_frame_t a52_get_iec958_frame(void)
+{
+#ifdef HAVE_AVX2_FRAME
+	if (__builtin_cpu_supports("avx2"))
+		return a52_iec958_frame_avx2;
+#endif
+#if defined(__SSE2__)
+	return a52_iec958_frame_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return a52_iec958_frame_neon;
+#else
+	return a52_iec958_frame_c;
+#endif
+}
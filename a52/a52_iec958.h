@@ -0,0 +1,40 @@
+/*
+ * A52 Output Plugin - IEC958 burst framing
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __A52_IEC958_H
+#define __A52_IEC958_H
+
+/*
+ * Turn an encoded A52 frame into an IEC958 burst in place.
+ *
+ * The payload of payload bytes is at burst + 8.  The 8-byte preamble is
+ * written in front of it, the whole burst of size bytes is byte-swapped
+ * when swap is set (for S16_LE output), and everything after the payload
+ * is zeroed.  size must be a multiple of 32.
+ */
+typedef void (*a52_iec958_frame_t)(unsigned char *burst, unsigned int payload,
+				   unsigned int size, int swap);
+
+/* the fastest implementation this CPU supports */
+a52_iec958_frame_t a52_get_iec958_frame(void);
+
+/* the plain C version, for comparison */
+void a52_iec958_frame_c(unsigned char *burst, unsigned int payload,
+			unsigned int size, int swap);
+
+#endif
@@ -0,0 +1,431 @@
+/*
+ * A52 Output Plugin - splitting the input into planar float
+ *
+ * Deinterleaves, reorders and converts the application's data for the
+ * encoder in one pass.  The 6 channel case has SSE2/AVX2 kernels for
+ * all formats and a NEON one for S16; they work on groups of 4 or 8
+ * frames, which are a small matrix of samples to transpose.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <stdint.h>
+#include "a52_planar.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_PLANAR
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define S16_SCALE	(1.0f / 32768.0f)
+#define S32_SCALE	(1.0f / 2147483648.0f)
+
+enum { FMT_S16, FMT_S32, FMT_FLOAT };
+
+/* source channel of each plane */
+static const unsigned int smpte_order[3][6] = {
+	{ 0, 1 },
+	{ 0, 1, 2, 3 },
+	{ 0, 1, 4, 5, 2, 3 },
+};
+
+/* fmt and channels are constants in every caller, so this inlines to
+ * one tight loop per plane
+ */
+static inline void planar_c(float *const *planes, const void *src,
+			    unsigned int frames, unsigned int channels, int fmt)
+{
+	const unsigned int *order = smpte_order[channels / 2 - 1];
+	unsigned int i, ch;
+
+	for (ch = 0; ch < channels; ch++) {
+		float *d = planes[ch];
+		switch (fmt) {
+		case FMT_S16: {
+			const int16_t *s = (const int16_t *)src + order[ch];
+			for (i = 0; i < frames; i++, s += channels)
+				d[i] = *s * S16_SCALE;
+			break;
+		}
+		case FMT_S32: {
+			const int32_t *s = (const int32_t *)src + order[ch];
+			for (i = 0; i < frames; i++, s += channels)
+				d[i] = *s * S32_SCALE;
+			break;
+		}
+		case FMT_FLOAT: {
+			const float *s = (const float *)src + order[ch];
+			for (i = 0; i < frames; i++, s += channels)
+				d[i] = *s;
+			break;
+		}
+		}
+	}
+}
+
+#define DEFINE_PLANAR_C(fmt, name, channels)				\
+static void planar_##name##_##channels##_c(float *const *planes,	\
+					   const void *src,		\
+					   unsigned int frames)		\
+{									\
+	planar_c(planes, src, frames, channels, fmt);			\
+}
+
+DEFINE_PLANAR_C(FMT_S16, s16, 2)
+DEFINE_PLANAR_C(FMT_S16, s16, 4)
+DEFINE_PLANAR_C(FMT_S32, s32, 2)
+DEFINE_PLANAR_C(FMT_S32, s32, 4)
+DEFINE_PLANAR_C(FMT_S32, s32, 6)
+DEFINE_PLANAR_C(FMT_FLOAT, float, 2)
+DEFINE_PLANAR_C(FMT_FLOAT, float, 4)
+DEFINE_PLANAR_C(FMT_FLOAT, float, 6)
+
+void a52_planar_s16_6_c(float *const *planes, const void *src,
+			unsigned int frames)
+{
+	planar_c(planes, src, frames, 6, FMT_S16);
+}
+
+static const a52_planar_t planar_c_table[3][3] = {
+	{ planar_s16_2_c, planar_s16_4_c, a52_planar_s16_6_c },
+	{ planar_s32_2_c, planar_s32_4_c, planar_s32_6_c },
+	{ planar_float_2_c, planar_float_4_c, planar_float_6_c },
+};
+
+/* the remaining frames of a 6 channel kernel, from frame done on */
+static void planar_6_tail(float *const *planes, const void *src,
+			  unsigned int done, unsigned int frames, int fmt)
+{
+	float *p[6];
+	unsigned int ch;
+
+	for (ch = 0; ch < 6; ch++)
+		p[ch] = planes[ch] + done;
+	if (fmt == FMT_S16)
+		src = (const int16_t *)src + done * 6;
+	else
+		src = (const int32_t *)src + done * 6;
+	planar_c_table[fmt][2](p, src, frames - done);
+}
+
+#if defined(__SSE2__)
+/*
+ * 4 frames are 24 samples, a0..a5 as floats:
+ *
+ *   a0 = 0:FL 0:FR 0:RL 0:RR    a1 = 0:FC 0:LFE 1:FL 1:FR
+ *   a2 = 1:RL 1:RR 1:FC 1:LFE   a3..a5 the same for frames 2 and 3
+ *
+ * The first four channels of each frame are put together and
+ * transposed as a 4x4 matrix, FC and LFE are picked out separately.
+ */
+static inline void store_6x4_sse2(float *const *planes, unsigned int i,
+				  __m128 a0, __m128 a1, __m128 a2,
+				  __m128 a3, __m128 a4, __m128 a5)
+{
+	__m128 r0 = a0;
+	__m128 r1 = _mm_shuffle_ps(a1, a2, _MM_SHUFFLE(1, 0, 3, 2));
+	__m128 r2 = a3;
+	__m128 r3 = _mm_shuffle_ps(a4, a5, _MM_SHUFFLE(1, 0, 3, 2));
+	__m128 t0 = _mm_shuffle_ps(a1, a2, _MM_SHUFFLE(3, 2, 1, 0));
+	__m128 t1 = _mm_shuffle_ps(a4, a5, _MM_SHUFFLE(3, 2, 1, 0));
+
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps(planes[0] + i, r0);
+	_mm_storeu_ps(planes[1] + i, r1);
+	_mm_storeu_ps(planes[4] + i, r2);
+	_mm_storeu_ps(planes[5] + i, r3);
+	_mm_storeu_ps(planes[2] + i,
+		      _mm_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_storeu_ps(planes[3] + i,
+		      _mm_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+static inline __m128 s16x4_to_float(__m128i v)
+{
+	/* sign extend by shifting the sample down from the upper half */
+	return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(v, 16)),
+			  _mm_set1_ps(S16_SCALE));
+}
+
+static void planar_s16_6_sse2(float *const *planes, const void *src,
+			      unsigned int frames)
+{
+	unsigned int i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		const __m128i *s = (const __m128i *)((const int16_t *)src + i * 6);
+		__m128i v0 = _mm_loadu_si128(s);
+		__m128i v1 = _mm_loadu_si128(s + 1);
+		__m128i v2 = _mm_loadu_si128(s + 2);
+
+		store_6x4_sse2(planes, i,
+			       s16x4_to_float(_mm_unpacklo_epi16(v0, v0)),
+			       s16x4_to_float(_mm_unpackhi_epi16(v0, v0)),
+			       s16x4_to_float(_mm_unpacklo_epi16(v1, v1)),
+			       s16x4_to_float(_mm_unpackhi_epi16(v1, v1)),
+			       s16x4_to_float(_mm_unpacklo_epi16(v2, v2)),
+			       s16x4_to_float(_mm_unpackhi_epi16(v2, v2)));
+	}
+	planar_6_tail(planes, src, i, frames, FMT_S16);
+}
+
+static inline __m128 s32x4_to_float(const int32_t *s)
+{
+	return _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)s)),
+			  _mm_set1_ps(S32_SCALE));
+}
+
+static void planar_s32_6_sse2(float *const *planes, const void *src,
+			      unsigned int frames)
+{
+	unsigned int i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		const int32_t *s = (const int32_t *)src + i * 6;
+
+		store_6x4_sse2(planes, i,
+			       s32x4_to_float(s), s32x4_to_float(s + 4),
+			       s32x4_to_float(s + 8), s32x4_to_float(s + 12),
+			       s32x4_to_float(s + 16), s32x4_to_float(s + 20));
+	}
+	planar_6_tail(planes, src, i, frames, FMT_S32);
+}
+
+static void planar_float_6_sse2(float *const *planes, const void *src,
+				unsigned int frames)
+{
+	unsigned int i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		const float *s = (const float *)src + i * 6;
+
+		store_6x4_sse2(planes, i,
+			       _mm_loadu_ps(s), _mm_loadu_ps(s + 4),
+			       _mm_loadu_ps(s + 8), _mm_loadu_ps(s + 12),
+			       _mm_loadu_ps(s + 16), _mm_loadu_ps(s + 20));
+	}
+	planar_6_tail(planes, src, i, frames, FMT_FLOAT);
+}
+#endif
+
+#ifdef HAVE_AVX2_PLANAR
+/* The SSE2 scheme on 8 frames, with frames 0-3 in the lower and
+ * frames 4-7 in the upper 128-bit lane of every register.  The
+ * shuffles work per lane, so the planes come out in frame order.
+ */
+__attribute__((target("avx2")))
+static inline void store_6x8_avx2(float *const *planes, unsigned int i,
+				  __m256 a0, __m256 a1, __m256 a2,
+				  __m256 a3, __m256 a4, __m256 a5)
+{
+	__m256 r1 = _mm256_shuffle_ps(a1, a2, _MM_SHUFFLE(1, 0, 3, 2));
+	__m256 r3 = _mm256_shuffle_ps(a4, a5, _MM_SHUFFLE(1, 0, 3, 2));
+	__m256 t0 = _mm256_shuffle_ps(a1, a2, _MM_SHUFFLE(3, 2, 1, 0));
+	__m256 t1 = _mm256_shuffle_ps(a4, a5, _MM_SHUFFLE(3, 2, 1, 0));
+	/* 4x4 transpose of a0, r1, a3, r3 in each lane */
+	__m256 u0 = _mm256_unpacklo_ps(a0, r1);
+	__m256 u1 = _mm256_unpackhi_ps(a0, r1);
+	__m256 u2 = _mm256_unpacklo_ps(a3, r3);
+	__m256 u3 = _mm256_unpackhi_ps(a3, r3);
+
+	_mm256_storeu_ps(planes[0] + i, _mm256_shuffle_ps(u0, u2, _MM_SHUFFLE(1, 0, 1, 0)));
+	_mm256_storeu_ps(planes[1] + i, _mm256_shuffle_ps(u0, u2, _MM_SHUFFLE(3, 2, 3, 2)));
+	_mm256_storeu_ps(planes[4] + i, _mm256_shuffle_ps(u1, u3, _MM_SHUFFLE(1, 0, 1, 0)));
+	_mm256_storeu_ps(planes[5] + i, _mm256_shuffle_ps(u1, u3, _MM_SHUFFLE(3, 2, 3, 2)));
+	_mm256_storeu_ps(planes[2] + i, _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm256_storeu_ps(planes[3] + i, _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+/* 4 samples from each of two groups of 4 frames, 24 samples apart */
+__attribute__((target("avx2")))
+static inline __m256 s16x4x2_to_float(const int16_t *s)
+{
+	__m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)s),
+				       _mm_loadl_epi64((const __m128i *)(s + 24)));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)),
+			     _mm256_set1_ps(S16_SCALE));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 s32x4x2_to_float(const int32_t *s)
+{
+	__m256i v = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)s)),
+		_mm_loadu_si128((const __m128i *)(s + 24)), 1);
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(S32_SCALE));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 floatx4x2(const float *s)
+{
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(s)),
+				    _mm_loadu_ps(s + 24), 1);
+}
+
+__attribute__((target("avx2")))
+static void planar_s16_6_avx2(float *const *planes, const void *src,
+			      unsigned int frames)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const int16_t *s = (const int16_t *)src + i * 6;
+
+		store_6x8_avx2(planes, i,
+			       s16x4x2_to_float(s), s16x4x2_to_float(s + 4),
+			       s16x4x2_to_float(s + 8), s16x4x2_to_float(s + 12),
+			       s16x4x2_to_float(s + 16), s16x4x2_to_float(s + 20));
+	}
+	planar_6_tail(planes, src, i, frames, FMT_S16);
+}
+
+__attribute__((target("avx2")))
+static void planar_s32_6_avx2(float *const *planes, const void *src,
+			      unsigned int frames)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const int32_t *s = (const int32_t *)src + i * 6;
+
+		store_6x8_avx2(planes, i,
+			       s32x4x2_to_float(s), s32x4x2_to_float(s + 4),
+			       s32x4x2_to_float(s + 8), s32x4x2_to_float(s + 12),
+			       s32x4x2_to_float(s + 16), s32x4x2_to_float(s + 20));
+	}
+	planar_6_tail(planes, src, i, frames, FMT_S32);
+}
+
+__attribute__((target("avx2")))
+static void planar_float_6_avx2(float *const *planes, const void *src,
+				unsigned int frames)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const float *s = (const float *)src + i * 6;
+
+		store_6x8_avx2(planes, i,
+			       floatx4x2(s), floatx4x2(s + 4),
+			       floatx4x2(s + 8), floatx4x2(s + 12),
+			       floatx4x2(s + 16), floatx4x2(s + 20));
+	}
+	planar_6_tail(planes, src, i, frames, FMT_FLOAT);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+/* Each pair of channels is one 32-bit word, so vld3 splits 4 frames
+ * into FL/FR, RL/RR and FC/LFE; vuzp then separates the pairs of 8
+ * frames.
+ */
+static inline void store_s16x8(float *d, int16x8_t v)
+{
+	const float32x4_t scale = vdupq_n_f32(S16_SCALE);
+
+	vst1q_f32(d, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+	vst1q_f32(d + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+}
+
+static void planar_s16_6_neon(float *const *planes, const void *src,
+			      unsigned int frames)
+{
+	/* plane of the first channel of each pair */
+	static const unsigned int pair_plane[3] = { 0, 4, 2 };
+	unsigned int i, p;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const int32_t *s = (const int32_t *)((const int16_t *)src + i * 6);
+		int32x4x3_t lo = vld3q_s32(s);
+		int32x4x3_t hi = vld3q_s32(s + 12);
+		for (p = 0; p < 3; p++) {
+			int16x8x2_t c = vuzpq_s16(vreinterpretq_s16_s32(lo.val[p]),
+						  vreinterpretq_s16_s32(hi.val[p]));
+			store_s16x8(planes[pair_plane[p]] + i, c.val[0]);
+			store_s16x8(planes[pair_plane[p] + 1] + i, c.val[1]);
+		}
+	}
+	planar_6_tail(planes, src, i, frames, FMT_S16);
+}
+#endif
+
+a52_planar_t a52_get_planar(snd_pcm_format_t format, unsigned int channels)
+{
+	int fmt;
+#ifdef HAVE_AVX2_PLANAR
+	int avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+		fmt = FMT_S16;
+		break;
+	case SND_PCM_FORMAT_S32:
+		fmt = FMT_S32;
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		fmt = FMT_FLOAT;
+		break;
+	default:
+		return NULL;
+	}
+	if (channels != 2 && channels != 4 && channels != 6)
+		return NULL;
+	if (channels != 6)
+		return planar_c_table[fmt][channels / 2 - 1];
+
+	switch (fmt) {
+	case FMT_S16:
+#ifdef HAVE_AVX2_PLANAR
+		if (avx2)
+			return planar_s16_6_avx2;
+#endif
+#if defined(__SSE2__)
+		return planar_s16_6_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+		return planar_s16_6_neon;
+#else
+		return a52_planar_s16_6_c;
+#endif
+
+	case FMT_S32:
+#ifdef HAVE_AVX2_PLANAR
+		if (avx2)
+			return planar_s32_6_avx2;
+#endif
+#if defined(__SSE2__)
+		return planar_s32_6_sse2;
+#else
+		return planar_s32_6_c;
+#endif
+
+	default:
+#ifdef HAVE_AVX2_PLANAR
+		if (avx2)
+			return planar_float_6_avx2;
+#endif
+#if defined(__SSE2__)
+		return planar_float_6_sse2;
+#else
+		return planar_float_6_c;
+#endif
+	}
+}
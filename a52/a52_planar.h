@@ -0,0 +1,42 @@
+/*
+ * A52 Output Plugin - splitting the input into planar float
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __A52_PLANAR_H
+#define __A52_PLANAR_H
+
+#include <alsa/asoundlib.h>
+
+/*
+ * Split frames of interleaved samples into one float plane per channel,
+ * scaled to [-1, 1).  The planes are in the SMPTE order libavcodec
+ * expects, i.e. for 6 channels the ALSA order FL FR RL RR FC LFE
+ * becomes FL FR FC LFE RL RR.
+ */
+typedef void (*a52_planar_t)(float *const *planes, const void *src,
+			     unsigned int frames);
+
+/* the fastest implementation this CPU has for native S16, S32 or FLOAT
+ * with 2, 4 or 6 channels, or NULL for other formats
+ */
+a52_planar_t a52_get_planar(snd_pcm_format_t format, unsigned int channels);
+
+/* the plain C version for S16 and 6 channels, for comparison */
+void a52_planar_s16_6_c(float *const *planes, const void *src,
+			unsigned int frames);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * A52 Output Plugin - CPU time accounting for bench_a52
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __A52_PROFILE_H
+#define __A52_PROFILE_H
+
+/* Sections of the plugin's work.  Each gets the thread CPU time spent in
+ * it minus that of the sections it calls.
+ */
+enum {
+	A52_PROF_OTHER,		/* everything outside the sections below */
+	A52_PROF_FILL,		/* fill_data: deinterleave and convert */
+	A52_PROF_ENCODE,	/* encode_burst: libavcodec and IEC958 framing */
+	A52_PROF_WRITE,		/* write_out_pending: writes to the slave */
+	A52_PROF_SECTIONS
+};
+
+/* Only bench_a52 builds the plugin with A52_PROFILE and provides these;
+ * in the plugin itself the hooks are empty.
+ */
+#ifdef A52_PROFILE
+void a52_prof_enter(int section);
+void a52_prof_exit(void);
+#define A52_PROF_ENTER(section)	a52_prof_enter(section)
+#define A52_PROF_EXIT()		a52_prof_exit()
+#else
+#define A52_PROF_ENTER(section)	do { } while (0)
+#define A52_PROF_EXIT()		do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * Offline throughput benchmark for the A52 plugin
+ *
+ * Opens the a52 PCM on top of the "null" PCM and writes synthetic 5.1
+ * audio through it as fast as it goes, once per bitrate.  The plugin
+ * is linked in, built with A52_PROFILE, so the CPU time can be split
+ * between fill_data, the encoder and write_out_pending.  Allocations
+ * made while streaming are counted by wrapping glibc's allocator.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include "a52_profile.h"
+
+#define RATE		48000
+#define A52_FRAME_SIZE	1536
+
+/* the plugin's entry point, linked in from pcm_a52.c */
+int _snd_pcm_a52_open(snd_pcm_t **pcmp, const char *name,
+		      snd_config_t *root, snd_config_t *conf,
+		      snd_pcm_stream_t stream, int mode);
+
+/*
+ * CPU time per section, see a52_profile.h.  Every thread keeps a stack
+ * of the sections it is in and charges the time since the last switch
+ * to the innermost one.
+ */
+#define PROF_DEPTH	16
+
+static unsigned long long prof_ns[A52_PROF_SECTIONS];
+static __thread int prof_stack[PROF_DEPTH];
+static __thread int prof_depth;
+static __thread unsigned long long prof_last;
+
+static unsigned long long now_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void prof_switch(void)
+{
+	unsigned long long now = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	int section = prof_depth ? prof_stack[prof_depth - 1] : A52_PROF_OTHER;
+
+	if (prof_last)
+		__atomic_fetch_add(&prof_ns[section], now - prof_last,
+				   __ATOMIC_RELAXED);
+	prof_last = now;
+}
+
+void a52_prof_enter(int section)
+{
+	prof_switch();
+	if (prof_depth < PROF_DEPTH)
+		prof_stack[prof_depth] = section;
+	prof_depth++;
+}
+
+void a52_prof_exit(void)
+{
+	prof_switch();
+	prof_depth--;
+}
+
+/*
+ * Allocation counting.  glibc lets the program replace malloc and
+ * friends; these count and pass on to the real ones.  av_malloc()
+ * goes through posix_memalign().
+ */
+static unsigned long allocs;
+static int count_allocs;
+
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNT
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static inline void count_alloc(void)
+{
+	if (count_allocs)
+		__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	count_alloc();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	count_alloc();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	count_alloc();
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+	count_alloc();
+	return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	count_alloc();
+	return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+	count_alloc();
+	*ptr = __libc_memalign(align, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif
+
+/* open the plugin directly with a config built from text */
+static int open_a52(snd_pcm_t **pcm, snd_config_t **top, unsigned int bitrate,
+		    unsigned int channels, int threaded)
+{
+	char buf[256];
+	snd_config_t *conf;
+	snd_input_t *in;
+	int err;
+
+	snprintf(buf, sizeof(buf),
+		 "bench { type a52 slavepcm \"null\" bitrate %u channels %u "
+		 "threaded %s }\n", bitrate, channels,
+		 threaded ? "true" : "false");
+	if ((err = snd_config_top(top)) < 0)
+		return err;
+	if ((err = snd_input_buffer_open(&in, buf, -1)) < 0)
+		goto error;
+	err = snd_config_load(*top, in);
+	snd_input_close(in);
+	if (err < 0)
+		goto error;
+	if ((err = snd_config_search(*top, "bench", &conf)) < 0)
+		goto error;
+	err = _snd_pcm_a52_open(pcm, "bench", *top, conf,
+				SND_PCM_STREAM_PLAYBACK, 0);
+	if (err >= 0)
+		return 0;
+ error:
+	snd_config_delete(*top);
+	return err;
+}
+
+/* the plugin only takes periods of one A52 frame */
+static int set_params(snd_pcm_t *pcm, snd_pcm_format_t format,
+		      unsigned int channels)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_uframes_t period = A52_FRAME_SIZE, buffer = period * 4;
+	int err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+	    (err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+	    (err = snd_pcm_hw_params_set_format(pcm, hw, format)) < 0 ||
+	    (err = snd_pcm_hw_params_set_channels(pcm, hw, channels)) < 0 ||
+	    (err = snd_pcm_hw_params_set_rate(pcm, hw, RATE, 0)) < 0 ||
+	    (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, NULL)) < 0 ||
+	    (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer)) < 0 ||
+	    (err = snd_pcm_hw_params(pcm, hw)) < 0)
+		return err;
+	return 0;
+}
+
+/* a different tone on every channel, at -6 dB */
+static void *make_signal(snd_pcm_format_t format, unsigned int channels,
+			 unsigned int frames)
+{
+	unsigned int width = snd_pcm_format_width(format) / 8;
+	unsigned char *buf = malloc(frames * channels * width);
+	unsigned int i, ch;
+
+	if (! buf)
+		return NULL;
+	for (i = 0; i < frames; i++) {
+		for (ch = 0; ch < channels; ch++) {
+			float v = 0.5f * sinf(2 * M_PI * 220.0 * (ch + 1) * i / RATE);
+			void *p = buf + (i * channels + ch) * width;
+			if (format == SND_PCM_FORMAT_FLOAT)
+				*(float *)p = v;
+			else if (format == SND_PCM_FORMAT_S32)
+				*(int *)p = (int)(v * 2147483647.0f);
+			else
+				*(short *)p = (short)(v * 32767.0f);
+		}
+	}
+	return buf;
+}
+
+static int run_one(unsigned int bitrate, snd_pcm_format_t format,
+		   unsigned int channels, snd_pcm_uframes_t period,
+		   int threaded, double seconds)
+{
+	snd_pcm_t *pcm;
+	snd_config_t *top;
+	unsigned long long t0, cpu0, total, frames = 0;
+	unsigned long stream_allocs;
+	double wall, cpu, prof_sum = 0;
+	void *buf;
+	int i, err;
+
+	if ((err = open_a52(&pcm, &top, bitrate, channels, threaded)) < 0) {
+		fprintf(stderr, "Cannot open a52 PCM: %s\n", snd_strerror(err));
+		return err;
+	}
+	if ((err = set_params(pcm, format, channels)) < 0) {
+		fprintf(stderr, "Cannot set hw params: %s\n", snd_strerror(err));
+		goto out;
+	}
+	/* one second of signal, played over and over */
+	buf = make_signal(format, channels, RATE + period);
+	if (! buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* everything set up by hw_params and prepare is left out */
+	memset(prof_ns, 0, sizeof(prof_ns));
+	prof_last = 0;
+	allocs = 0;
+	count_allocs = 1;
+	total = seconds * RATE;
+	t0 = now_ns(CLOCK_MONOTONIC);
+	cpu0 = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+	a52_prof_enter(A52_PROF_OTHER);
+
+	while (frames < total) {
+		snd_pcm_uframes_t pos = frames % (RATE - RATE % period);
+		snd_pcm_sframes_t rc;
+
+		rc = snd_pcm_writei(pcm, (unsigned char *)buf +
+				    snd_pcm_frames_to_bytes(pcm, pos), period);
+		if (rc == -EPIPE) {
+			snd_pcm_prepare(pcm);
+			continue;
+		}
+		if (rc < 0) {
+			fprintf(stderr, "Write failed: %s\n", snd_strerror(rc));
+			break;
+		}
+		frames += rc;
+	}
+	snd_pcm_drain(pcm);
+
+	a52_prof_exit();
+	count_allocs = 0;
+	stream_allocs = allocs;
+	wall = (now_ns(CLOCK_MONOTONIC) - t0) / 1e9;
+	cpu = (now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu0) / 1e9;
+	for (i = 0; i < A52_PROF_SECTIONS; i++)
+		prof_sum += prof_ns[i];
+	if (prof_sum <= 0)
+		prof_sum = 1;
+
+	printf("%7u %6lu %12.0f %8.1f %8.2f %6.1f %6.1f %6.1f %6.1f %8lu %8.2f\n",
+	       bitrate, period, frames / wall, frames / (wall * RATE),
+	       cpu * 1e6 / (frames / (double)A52_FRAME_SIZE),
+	       prof_ns[A52_PROF_FILL] * 100 / prof_sum,
+	       prof_ns[A52_PROF_ENCODE] * 100 / prof_sum,
+	       prof_ns[A52_PROF_WRITE] * 100 / prof_sum,
+	       prof_ns[A52_PROF_OTHER] * 100 / prof_sum,
+	       stream_allocs,
+	       stream_allocs / (frames / (double)A52_FRAME_SIZE));
+	free(buf);
+ out:
+	snd_pcm_close(pcm);
+	snd_config_delete(top);
+	return err;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -m minutes    minutes of audio per run (default 1)\n"
+		"  -b list       bitrates in kbps, comma separated\n"
+		"                (default 192,384,448,640)\n"
+		"  -c channels   2, 4 or 6 (default 6)\n"
+		"  -f format     S16, S32 or FLOAT (default S16)\n"
+		"  -p frames     frames per write (default 1536)\n"
+		"  -t            use the plugin's threaded mode\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *list = "192,384,448,640";
+	snd_pcm_format_t format = SND_PCM_FORMAT_S16;
+	unsigned int channels = 6;
+	snd_pcm_uframes_t period = A52_FRAME_SIZE;
+	double minutes = 1;
+	int threaded = 0;
+	char *rates, *tok, *save = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:b:c:f:p:th")) != -1) {
+		switch (c) {
+		case 'm':
+			minutes = atof(optarg);
+			break;
+		case 'b':
+			list = optarg;
+			break;
+		case 'c':
+			channels = atoi(optarg);
+			break;
+		case 'f':
+			format = snd_pcm_format_value(optarg);
+			break;
+		case 'p':
+			period = atol(optarg);
+			break;
+		case 't':
+			threaded = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (minutes <= 0 || ! period || period > RATE ||
+	    (format != SND_PCM_FORMAT_S16 && format != SND_PCM_FORMAT_S32 &&
+	     format != SND_PCM_FORMAT_FLOAT)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("# %u Hz, %u ch, %s, %.1f min per run, %s, null slave\n",
+	       RATE, channels, snd_pcm_format_name(format), minutes,
+	       threaded ? "threaded" : "inline");
+	printf("# cpu us is per A52 frame, the split is in %% of the "
+	       "plugin's CPU time%s\n",
+#ifdef HAVE_ALLOC_COUNT
+	       ""
+#else
+	       ", allocations are not counted on this libc"
+#endif
+	       );
+	printf("%7s %6s %12s %8s %8s %6s %6s %6s %6s %8s %8s\n",
+	       "kbps", "write", "frames/s", "x rt", "cpu us",
+	       "fill", "encode", "write", "other", "allocs", "/frame");
+
+	rates = strdup(list);
+	for (tok = strtok_r(rates, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save))
+		run_one(atoi(tok), format, channels, period, threaded,
+			minutes * 60);
+	free(rates);
+	return 0;
+}
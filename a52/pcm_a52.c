@@ -20,80 +20,336 @@
 
 #include <stdio.h>
 #include <string.h>
-#define __USE_XOPEN
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
 #include <alsa/pcm_plugin.h>
 #include AVCODEC_HEADER
+#include <libavutil/channel_layout.h>
+#include "a52_iec958.h"
+#include "a52_planar.h"
+#include "a52_profile.h"
+
+#define A52_FRAME_SIZE	1536
+
+/* number of A52 frames each ring of the pipelined mode holds */
+#define A52_RING_SIZE	4
+
+/* AVChannelLayout replaced the channel_layout mask in libavcodec 59.24 */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59, 24, 100)
+#define A52_CH_LAYOUT
+#endif
+
+/* the encoder can get its packet buffers from us since 58.134 */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+#define A52_ENCODER_BUFFER
+#endif
 
 struct a52_ctx {
 	snd_pcm_ioplug_t io;
 	snd_pcm_t *slave;
-	AVCodec *codec;
+	const AVCodec *codec;
 	AVCodecContext *avctx;
+	AVFrame *frame;		/* planar float block being filled */
+	AVPacket *pkt;
+	AVBufferPool *pkt_pool;
 	snd_pcm_format_t format;
 	unsigned int channels;
 	unsigned int rate;
 	unsigned int bitrate;
-	short *inbuf;
 	unsigned char *outbuf;
 	int outbuf_size;
+	a52_iec958_frame_t iec958_frame;
+	a52_planar_t planar;	/* for interleaved input */
 	snd_pcm_uframes_t transfer;
 	int remain;
+	int sent;		/* frames of outbuf already written */
 	int filled;
 	unsigned int slave_period_size;
 	unsigned int slave_buffer_size;
 	snd_pcm_hw_params_t *hw_params;
+	int slave_mmap;		/* slave has MMAP_INTERLEAVED access */
+	snd_pcm_uframes_t start_threshold;
+
+	/* Pipelined mode: the application fills PCM blocks of one A52
+	 * frame, an encoder thread turns them into IEC958 bursts.  Both
+	 * rings are single-producer single-consumer; the semaphores count
+	 * free and ready slots.  In this mode outbuf points to the burst
+	 * being written to the slave.  The inline mode only uses blocks[0].
+	 */
+	int threaded;
+	pthread_t enc_thread;
+	int enc_running;
+	int enc_quit;
+	AVFrame *blocks[A52_RING_SIZE];
+	unsigned char *bursts;
+	unsigned int in_head;	/* blocks handed to the encoder */
+	unsigned int in_tail;	/* blocks encoded (encoder thread only) */
+	unsigned int out_head;	/* bursts produced (encoder thread only) */
+	unsigned int out_tail;	/* bursts taken for the slave */
+	int cur_burst;		/* outbuf is a ring slot to release */
+	sem_t in_free, in_ready, out_free, out_ready;
 };
 
+/* encode one A52 frame from a block into an IEC958 burst at outbuf */
+static void encode_burst(struct a52_ctx *rec, AVFrame *frame,
+			 unsigned char *outbuf)
+{
+	AVPacket *pkt = rec->pkt;
+	int out_bytes = 0;
+
+	A52_PROF_ENTER(A52_PROF_ENCODE);
+	/* the ac3 encoder has no delay, one frame in gives one packet out */
+	if (avcodec_send_frame(rec->avctx, frame) == 0 &&
+	    avcodec_receive_packet(rec->avctx, pkt) == 0) {
+		out_bytes = pkt->size;
+		if (out_bytes > rec->outbuf_size - 8)
+			out_bytes = rec->outbuf_size - 8;
+		memcpy(outbuf + 8, pkt->data, out_bytes);
+		av_packet_unref(pkt);
+	}
+	/* the encoder has dropped its reference, this doesn't copy */
+	av_frame_make_writable(frame);
+	/* preamble, byte swap for little-endian 16bit and zero padding */
+	rec->iec958_frame(outbuf, out_bytes, rec->outbuf_size,
+			  rec->format == SND_PCM_FORMAT_S16_LE);
+	A52_PROF_EXIT();
+}
+
+static int write_out_pending(snd_pcm_ioplug_t *io, struct a52_ctx *rec);
+
 /* convert the PCM data to A52 stream in IEC958 */
 static void convert_data(struct a52_ctx *rec)
 {
-	int out_bytes;
-
-	out_bytes = avcodec_encode_audio(rec->avctx, rec->outbuf + 8,
-					 rec->outbuf_size - 8,
-					 rec->inbuf);
-	rec->outbuf[0] = 0xf8; /* sync words */
-	rec->outbuf[1] = 0x72;
-	rec->outbuf[2] = 0x4e;
-	rec->outbuf[3] = 0x1f;
-	rec->outbuf[4] = rec->outbuf[13] & 7; /* bsmod */
-	rec->outbuf[5] = 0x01; /* data type */
-	rec->outbuf[6] = ((out_bytes * 8) >> 8) & 0xff;
-	rec->outbuf[7] = (out_bytes * 8) & 0xff;
-	/* swap bytes for little-endian 16bit */
-	if (rec->format == SND_PCM_FORMAT_S16_LE)
-		swab(rec->outbuf, rec->outbuf, out_bytes + 8);
-	memset(rec->outbuf +  8 + out_bytes, 0,
-	       rec->outbuf_size - 8 - out_bytes);
+	encode_burst(rec, rec->frame, rec->outbuf);
 	rec->remain = rec->outbuf_size / 4;
+	rec->sent = 0;
+	rec->filled = 0;
+}
+
+/* Encode the filled block straight into the mmap buffer of the slave.
+ * This needs room for the whole burst in one piece, which is normally
+ * the case as the slave periods are A52 frames.
+ *
+ * Returns 1 when done, 0 if the burst has to go through outbuf instead.
+ */
+static int encode_to_slave(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames, need = rec->outbuf_size / 4;
+	snd_pcm_sframes_t avail;
+	int err;
+
+	if (! rec->slave_mmap || rec->remain)
+		return 0;
+
+	for (;;) {
+		avail = snd_pcm_avail_update(rec->slave);
+		if (avail < 0) {
+			if (avail == -EPIPE)
+				io->state = SND_PCM_STATE_XRUN;
+			return avail;
+		}
+		if ((snd_pcm_uframes_t)avail >= need)
+			break;
+		/* a slave that isn't running yet won't make room */
+		if (io->nonblock ||
+		    snd_pcm_state(rec->slave) != SND_PCM_STATE_RUNNING)
+			return 0;
+		snd_pcm_wait(rec->slave, -1);
+	}
+
+	frames = need;
+	if ((err = snd_pcm_mmap_begin(rec->slave, &areas, &offset, &frames)) < 0)
+		return err;
+	if (frames < need ||
+	    areas[0].step != 32 || areas[0].first != 0 ||
+	    areas[1].addr != areas[0].addr || areas[1].first != 16) {
+		snd_pcm_mmap_commit(rec->slave, offset, 0);
+		return 0;
+	}
+
+	encode_burst(rec, rec->frame,
+		     (unsigned char *)areas[0].addr + offset * 4);
+	err = snd_pcm_mmap_commit(rec->slave, offset, need);
+	if (err < 0)
+		return err;
 	rec->filled = 0;
+
+	/* unlike writei, a commit doesn't start the stream by itself */
+	if (snd_pcm_state(rec->slave) == SND_PCM_STATE_PREPARED) {
+		avail = snd_pcm_avail_update(rec->slave);
+		if (avail >= 0 && rec->slave_buffer_size -
+		    (snd_pcm_uframes_t)avail >= rec->start_threshold)
+			snd_pcm_start(rec->slave);
+	}
+	return 1;
+}
+
+/* encode the filled block and send it to the slave */
+static int output_block(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	int err;
+
+	err = encode_to_slave(io, rec);
+	if (err)
+		return err < 0 ? err : 0;
+	convert_data(rec);
+	return write_out_pending(io, rec);
+}
+
+/* encoder thread of the pipelined mode */
+static void *a52_encoder(void *data)
+{
+	struct a52_ctx *rec = data;
+
+	for (;;) {
+		sem_wait(&rec->in_ready);
+		if (rec->enc_quit)
+			break;
+		sem_wait(&rec->out_free);
+		if (rec->enc_quit)
+			break;
+		encode_burst(rec, rec->blocks[rec->in_tail % A52_RING_SIZE],
+			     rec->bursts + (rec->out_head % A52_RING_SIZE) *
+			     rec->outbuf_size);
+		rec->in_tail++;
+		rec->out_head++;
+		sem_post(&rec->in_free);
+		sem_post(&rec->out_ready);
+	}
+	return NULL;
+}
+
+/* release the burst just written and take the next one from the
+ * encoder; returns 0 if there is none ready and wait is not set
+ */
+static int take_burst(struct a52_ctx *rec, int wait)
+{
+	if (rec->cur_burst) {
+		sem_post(&rec->out_free);
+		rec->cur_burst = 0;
+	}
+	if (wait)
+		sem_wait(&rec->out_ready);
+	else if (sem_trywait(&rec->out_ready) < 0)
+		return 0;
+	rec->outbuf = rec->bursts + (rec->out_tail % A52_RING_SIZE) *
+		rec->outbuf_size;
+	rec->out_tail++;
+	rec->remain = rec->outbuf_size / 4;
+	rec->sent = 0;
+	rec->cur_burst = 1;
+	return 1;
+}
+
+/* frames taken from the application that are not in the slave yet,
+ * not counting the partly filled block
+ */
+static snd_pcm_sframes_t a52_queued(struct a52_ctx *rec)
+{
+	snd_pcm_sframes_t frames = rec->remain;
+
+	if (rec->threaded && rec->avctx)
+		frames += (snd_pcm_sframes_t)(rec->in_head - rec->out_tail) *
+			rec->avctx->frame_size;
+	return frames;
 }
 
 /* write pending encoded data to the slave pcm */
-static int write_out_pending(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+static int __write_out_pending(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
 {
-	int err, ofs = 0;
+	int err;
+
+	/* in pipelined mode, go on with whatever the encoder has ready */
+	if (rec->threaded && ! rec->remain)
+		take_burst(rec, 0);
 
 	if (! rec->remain)
 		return 0;
 
 	while (rec->remain) {
-		err = snd_pcm_writei(rec->slave, rec->outbuf + ofs, rec->remain);
+		if (rec->slave_mmap)
+			err = snd_pcm_mmap_writei(rec->slave,
+						  rec->outbuf + rec->sent * 4,
+						  rec->remain);
+		else
+			err = snd_pcm_writei(rec->slave,
+					     rec->outbuf + rec->sent * 4,
+					     rec->remain);
+		if (err == -EAGAIN && ! io->nonblock) {
+			/* a slave opened nonblocking doesn't wait for room
+			 * by itself; do it here, a period at a time, rather
+			 * than retry right away
+			 */
+			err = snd_pcm_wait(rec->slave, rec->slave_period_size *
+					   1000 / rec->rate + 1);
+			if (err < 0)
+				return err;
+			continue;
+		}
 		if (err < 0) {
 			if (err == -EPIPE)
 				io->state = SND_PCM_STATE_XRUN;
 			return err;
 		} else if (! err)
 			break;
-		if (err < rec->remain)
-			ofs += (rec->remain - err) * 4;
+		rec->sent += err;
 		rec->remain -= err;
 	}
-	if (rec->remain && ofs)
-		memmove(rec->outbuf, rec->outbuf + ofs, rec->remain * 4);
+	if (rec->threaded && ! rec->remain)
+		return write_out_pending(io, rec);
+	return 0;
+}
+
+static int write_out_pending(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	int err;
+
+	A52_PROF_ENTER(A52_PROF_WRITE);
+	err = __write_out_pending(io, rec);
+	A52_PROF_EXIT();
+	return err;
+}
+
+/* write bursts to the slave until the encoder has made some progress;
+ * a nonblocking stream gets -EAGAIN instead of waiting for it
+ */
+static int push_bursts(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	int err;
+
+	if (! rec->remain && ! take_burst(rec, ! io->nonblock))
+		return -EAGAIN;
+	if ((err = write_out_pending(io, rec)) < 0)
+		return err;
+	if (rec->remain) {
+		if (io->nonblock)
+			return -EAGAIN;
+		snd_pcm_wait(rec->slave, -1);
+	}
+	return 0;
+}
+
+/* hand the filled block to the encoder thread and switch to a free one,
+ * writing bursts to the slave while waiting for it.  Nothing is queued
+ * until the free block is there, so on an error rec->frame still is the
+ * full block, which is queued again on the next call.
+ */
+static int queue_block(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	int err;
+
+	while (sem_trywait(&rec->in_free) < 0) {
+		if ((err = push_bursts(io, rec)) < 0)
+			return err;
+	}
+	rec->in_head++;
+	sem_post(&rec->in_ready);
+	rec->frame = rec->blocks[rec->in_head % A52_RING_SIZE];
+	rec->filled = 0;
 	return 0;
 }
 
@@ -103,56 +359,96 @@ static int write_out_pending(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
 static int a52_drain(snd_pcm_ioplug_t *io)
 {
 	struct a52_ctx *rec = io->private_data;
+	unsigned int ch;
 	int err;
 
 	if (rec->filled) {
 		if ((err = write_out_pending(io, rec)) < 0)
 			return err;
 		/* remaining data must be converted and sent out */
-		memset(rec->inbuf + rec->filled * io->channels, 0,
-		       (rec->avctx->frame_size - rec->filled) * io->channels * 2);
-		convert_data(rec);
+		for (ch = 0; ch < io->channels; ch++)
+			memset((float *)rec->frame->data[ch] + rec->filled, 0,
+			       (rec->avctx->frame_size - rec->filled) *
+			       sizeof(float));
+		if (rec->threaded)
+			err = queue_block(io, rec);
+		else
+			err = output_block(io, rec);
+		if (err < 0)
+			return err;
 	}
 	err = write_out_pending(io, rec);
 	if (err < 0)
 		return err;
+	/* wait for the encoder to finish the queued blocks */
+	while (rec->threaded && (rec->remain || rec->in_head != rec->out_tail)) {
+		if ((err = push_bursts(io, rec)) < 0)
+			return err;
+	}
 	snd_pcm_drain(rec->slave);
 	return 0;
 }
 
 /* check whether the areas consist of a continuous interleaved stream */
 static int check_interleaved(const snd_pcm_channel_area_t *areas,
-			     unsigned int channels)
+			     unsigned int channels, unsigned int bits)
 {
 	unsigned int ch;
 
-	if (channels > 4) /* we need re-routing for 6 channels */
-		return 0;
-
 	for (ch = 0; ch < channels; ch++) {
 		if (areas[ch].addr != areas[0].addr ||
-		    areas[ch].first != ch * 16 ||
-		    areas[ch].step != channels * 16)
+		    areas[ch].first != ch * bits ||
+		    areas[ch].step != channels * bits)
 			return 0;
 	}
 	return 1;
 }
 
-/* Fill the input PCM to the internal buffer until a52 frames,
+/* convert one channel of any layout into a plane of floats */
+static void copy_channel(float *dst, const snd_pcm_channel_area_t *ap,
+			 unsigned int offset, unsigned int size,
+			 snd_pcm_format_t format)
+{
+	const char *src = (const char *)ap->addr +
+		(ap->first + offset * ap->step) / 8;
+	unsigned int i, src_step = ap->step / 8; /* in bytes */
+
+	switch (format) {
+	case SND_PCM_FORMAT_S32:
+		for (i = 0; i < size; i++, src += src_step)
+			dst[i] = *(const int *)src * (1.0f / 2147483648.0f);
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		for (i = 0; i < size; i++, src += src_step)
+			dst[i] = *(const float *)src;
+		break;
+	default:
+		for (i = 0; i < size; i++, src += src_step)
+			dst[i] = *(const short *)src * (1.0f / 32768.0f);
+		break;
+	}
+}
+
+/* Fill the input PCM to the internal block until a52 frames,
  * then covert and write it out.
  *
  * Returns the number of processed frames.
  */
-static int fill_data(snd_pcm_ioplug_t *io,
-		     const snd_pcm_channel_area_t *areas,
-		     unsigned int offset, unsigned int size,
-		     int interleaved)
+static int __fill_data(snd_pcm_ioplug_t *io,
+		       const snd_pcm_channel_area_t *areas,
+		       unsigned int offset, unsigned int size,
+		       int interleaved)
 {
 	struct a52_ctx *rec = io->private_data;
 	unsigned int len = rec->avctx->frame_size - rec->filled;
-	short *src, *dst;
-	unsigned int src_step;
+	unsigned int ch;
 	int err;
+	/* libavcodec expects SMPTE order */
+	static unsigned int ch_index[3][6] = {
+		{ 0, 1 },
+		{ 0, 1, 2, 3 },
+		{ 0, 1, 4, 5, 2, 3 },
+	};
 
 	if ((err = write_out_pending(io, rec)) < 0)
 		return err;
@@ -160,48 +456,48 @@ static int fill_data(snd_pcm_ioplug_t *io,
 	if (size > len)
 		size = len;
 
-	dst = rec->inbuf + rec->filled * io->channels;
+	/* split into the planar float the encoder takes */
 	if (interleaved) {
-		memcpy(dst, areas->addr + offset * io->channels * 2,
-		       size * io->channels * 2);
+		float *planes[6];
+		for (ch = 0; ch < io->channels; ch++)
+			planes[ch] = (float *)rec->frame->data[ch] + rec->filled;
+		rec->planar(planes, (char *)areas->addr + offset *
+			    io->channels * snd_pcm_format_width(io->format) / 8,
+			    size);
 	} else {
-		unsigned int i, ch, dst_step;
-		short *dst1;
-		static unsigned int ch_index[3][6] = {
-			{ 0, 1 },
-			{ 0, 1, 2, 3 },
-#if LIBAVCODEC_VERSION_MAJOR > 52 || (LIBAVCODEC_VERSION_MAJOR == 52 && LIBAVCODEC_VERSION_MINOR >= 26)
-			/* current libavcodec expects SMPTE order */
-			{ 0, 1, 4, 5, 2, 3 },
-#else
-			/* libavcodec older than r18540 expects A52 order */
-			{ 0, 4, 1, 2, 3, 5 },
-#endif
-		};
-		/* flatten copy to n-channel interleaved */
-		dst_step = io->channels;
-		for (ch = 0; ch < io->channels; ch++, dst++) {
-			const snd_pcm_channel_area_t *ap;
-			ap = &areas[ch_index[io->channels / 2 - 1][ch]];
-			dst1 = dst;
-			src = (short *)(ap->addr +
-					(ap->first + offset * ap->step) / 8);
-			src_step = ap->step / 16; /* in word */
-			for (i = 0; i < size; i++) {
-				*dst1 = *src;
-				src += src_step;
-				dst1 += dst_step;
-			}
-		}
+		for (ch = 0; ch < io->channels; ch++)
+			copy_channel((float *)rec->frame->data[ch] + rec->filled,
+				     &areas[ch_index[io->channels / 2 - 1][ch]],
+				     offset, size, io->format);
 	}
 	rec->filled += size;
 	if (rec->filled == rec->avctx->frame_size) {
-		convert_data(rec);
-		write_out_pending(io, rec);
+		if (rec->threaded)
+			err = queue_block(io, rec);
+		else
+			err = output_block(io, rec);
+		/* the frames are taken either way; a block that couldn't
+		 * go out yet stays full and is sent on the next call
+		 */
+		if (err < 0 && ! size)
+			return err;
 	}
 	return (int)size;
 }
 
+static int fill_data(snd_pcm_ioplug_t *io,
+		     const snd_pcm_channel_area_t *areas,
+		     unsigned int offset, unsigned int size,
+		     int interleaved)
+{
+	int err;
+
+	A52_PROF_ENTER(A52_PROF_FILL);
+	err = __fill_data(io, areas, offset, size, interleaved);
+	A52_PROF_EXIT();
+	return err;
+}
+
 /*
  * transfer callback
  */
@@ -213,7 +509,8 @@ static snd_pcm_sframes_t a52_transfer(snd_pcm_ioplug_t *io,
 	struct a52_ctx *rec = io->private_data;
 	snd_pcm_sframes_t result = 0;
 	int err = 0;
-	int interleaved = check_interleaved(areas, io->channels);
+	int interleaved = check_interleaved(areas, io->channels,
+					    snd_pcm_format_width(io->format));
 
 	do {
 		err = fill_data(io, areas, offset, size, interleaved);
@@ -255,6 +552,8 @@ static snd_pcm_sframes_t a52_pointer(snd_pcm_ioplug_t *io)
 
 	if (delay < 0 || delay >= (snd_pcm_sframes_t)rec->slave_buffer_size)
 		delay = 0;
+	/* frames still in the plugin haven't been played either */
+	delay += a52_queued(rec);
 	delay = (snd_pcm_sframes_t)io->appl_ptr - delay;
 	if (delay < 0) {
 		delay += io->buffer_size;
@@ -265,6 +564,42 @@ static snd_pcm_sframes_t a52_pointer(snd_pcm_ioplug_t *io)
 	return delay;
 }
 
+/*
+ * delay callback
+ *
+ * The delay of the slave PCM plus what the plugin holds: the partly
+ * filled block, the bursts not written to the slave yet and the
+ * encoder's own delay.
+ */
+static int a52_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp)
+{
+	struct a52_ctx *rec = io->private_data;
+	snd_pcm_sframes_t delay = 0;
+	int err;
+
+	switch (snd_pcm_state(rec->slave)) {
+	case SND_PCM_STATE_RUNNING:
+	case SND_PCM_STATE_DRAINING:
+	case SND_PCM_STATE_PREPARED:
+		if ((err = snd_pcm_delay(rec->slave, &delay)) < 0)
+			return err;
+		break;
+	case SND_PCM_STATE_XRUN:
+	case SND_PCM_STATE_SUSPENDED:
+		return -EPIPE;
+	default:
+		break;
+	}
+
+	if (delay < 0)
+		delay = 0;
+	delay += a52_queued(rec) + rec->filled;
+	if (rec->avctx)
+		delay += rec->avctx->initial_padding;
+	*delayp = delay;
+	return 0;
+}
+
 /* set up the fixed parameters of slave PCM hw_parmas */
 static int a52_slave_hw_params_half(struct a52_ctx *rec)
 {
@@ -277,8 +612,13 @@ static int a52_slave_hw_params_half(struct a52_ctx *rec)
 		SNDERR("Cannot get slave hw_params");
 		goto out;
 	}
-	if ((err = snd_pcm_hw_params_set_access(rec->slave, rec->hw_params,
-						SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+	/* with mmap access the bursts can be encoded in place */
+	rec->slave_mmap = 0;
+	if (snd_pcm_hw_params_set_access(rec->slave, rec->hw_params,
+					 SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0)
+		rec->slave_mmap = 1;
+	else if ((err = snd_pcm_hw_params_set_access(rec->slave, rec->hw_params,
+						     SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
 		SNDERR("Cannot set slave access RW_INTERLEAVED");
 		goto out;
 	}
@@ -339,6 +679,7 @@ static int a52_hw_params(snd_pcm_ioplug_t *io,
 	}
 	rec->slave_period_size = period_size;
 	rec->slave_buffer_size = buffer_size;
+	rec->planar = a52_get_planar(io->format, io->channels);
 
 	return 0;
 }
@@ -381,6 +722,7 @@ static int a52_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *params)
 	snd_pcm_sw_params_set_avail_min(rec->slave, sparams, avail_min);
 	snd_pcm_sw_params_set_start_threshold(rec->slave, sparams,
 					      start_threshold);
+	rec->start_threshold = start_threshold;
 
 	return snd_pcm_sw_params(rec->slave, sparams);
 }
@@ -404,20 +746,135 @@ static int a52_stop(snd_pcm_ioplug_t *io)
 	return 0;
 }
 
+/* stop the encoder thread and release the rings */
+static void a52_stop_encoder(struct a52_ctx *rec)
+{
+	if (rec->enc_running) {
+		rec->enc_quit = 1;
+		sem_post(&rec->in_ready);
+		sem_post(&rec->out_free);
+		pthread_join(rec->enc_thread, NULL);
+		rec->enc_running = 0;
+		sem_destroy(&rec->in_free);
+		sem_destroy(&rec->in_ready);
+		sem_destroy(&rec->out_free);
+		sem_destroy(&rec->out_ready);
+	}
+	free(rec->bursts);
+	rec->bursts = NULL;
+}
+
+/* set up the burst ring and start the encoder thread */
+static int a52_start_encoder(struct a52_ctx *rec)
+{
+	rec->bursts = malloc(A52_RING_SIZE * rec->outbuf_size);
+	if (! rec->bursts)
+		return -ENOMEM;
+
+	/* the first block is the application's from the start */
+	sem_init(&rec->in_free, 0, A52_RING_SIZE - 1);
+	sem_init(&rec->in_ready, 0, 0);
+	sem_init(&rec->out_free, 0, A52_RING_SIZE);
+	sem_init(&rec->out_ready, 0, 0);
+	rec->in_head = rec->in_tail = 0;
+	rec->out_head = rec->out_tail = 0;
+	rec->cur_burst = 0;
+	rec->enc_quit = 0;
+	rec->outbuf = NULL;
+
+	if (pthread_create(&rec->enc_thread, NULL, a52_encoder, rec)) {
+		sem_destroy(&rec->in_free);
+		sem_destroy(&rec->in_ready);
+		sem_destroy(&rec->out_free);
+		sem_destroy(&rec->out_ready);
+		return -ENOMEM;
+	}
+	rec->enc_running = 1;
+	return 0;
+}
+
 /* release resources */
 static void a52_free(struct a52_ctx *rec)
 {
-	if (rec->avctx) {
-		avcodec_close(rec->avctx);
-		av_free(rec->avctx);
-		rec->avctx = NULL;
+	int i;
+
+	if (rec->threaded) {
+		a52_stop_encoder(rec);
+		/* outbuf pointed into the ring */
+		rec->outbuf = NULL;
 	}
-	free(rec->inbuf);
-	rec->inbuf = NULL;
+	for (i = 0; i < A52_RING_SIZE; i++)
+		av_frame_free(&rec->blocks[i]);
+	rec->frame = NULL;
+	av_packet_free(&rec->pkt);
+	avcodec_free_context(&rec->avctx);
+	av_buffer_pool_uninit(&rec->pkt_pool);
 	free(rec->outbuf);
 	rec->outbuf = NULL;
 }
 
+/* set the channel layout matching the SMPTE order of fill_data */
+static void a52_set_channel_layout(AVCodecContext *avctx,
+				   unsigned int channels)
+{
+#ifdef A52_CH_LAYOUT
+	static const AVChannelLayout layouts[3] = {
+		AV_CHANNEL_LAYOUT_STEREO,
+		AV_CHANNEL_LAYOUT_QUAD,
+		AV_CHANNEL_LAYOUT_5POINT1,
+	};
+	av_channel_layout_copy(&avctx->ch_layout, &layouts[channels / 2 - 1]);
+#else
+	static const uint64_t layouts[3] = {
+		AV_CH_LAYOUT_STEREO,
+		AV_CH_LAYOUT_QUAD,
+		AV_CH_LAYOUT_5POINT1,
+	};
+	avctx->channels = channels;
+	avctx->channel_layout = layouts[channels / 2 - 1];
+#endif
+}
+
+/* allocate a block of one A52 frame in the encoder's format */
+static AVFrame *a52_alloc_block(struct a52_ctx *rec)
+{
+	AVFrame *frame = av_frame_alloc();
+
+	if (! frame)
+		return NULL;
+	frame->nb_samples = rec->avctx->frame_size;
+	frame->format = rec->avctx->sample_fmt;
+#ifdef A52_CH_LAYOUT
+	av_channel_layout_copy(&frame->ch_layout, &rec->avctx->ch_layout);
+#else
+	frame->channel_layout = rec->avctx->channel_layout;
+#endif
+	if (av_frame_get_buffer(frame, 0) < 0)
+		av_frame_free(&frame);
+	return frame;
+}
+
+#ifdef A52_ENCODER_BUFFER
+/* hand out packet buffers from a pool, so that encoding a frame doesn't
+ * allocate the packet data.  It isn't allocation-free: the pool still
+ * makes a buffer reference per packet, and libavcodec references the
+ * frame it is given.  Older libavcodec allocates every packet.
+ */
+static int a52_get_encoder_buffer(AVCodecContext *avctx, AVPacket *pkt,
+				  int flags)
+{
+	struct a52_ctx *rec = avctx->opaque;
+
+	if (pkt->size > rec->outbuf_size)
+		return avcodec_default_get_encoder_buffer(avctx, pkt, flags);
+	pkt->buf = av_buffer_pool_get(rec->pkt_pool);
+	if (! pkt->buf)
+		return AVERROR(ENOMEM);
+	pkt->data = pkt->buf->data;
+	return 0;
+}
+#endif
+
 /*
  * prepare callback
  *
@@ -426,47 +883,62 @@ static void a52_free(struct a52_ctx *rec)
 static int a52_prepare(snd_pcm_ioplug_t *io)
 {
 	struct a52_ctx *rec = io->private_data;
+	int i, blocks;
 
 	a52_free(rec);
 
-	rec->avctx = avcodec_alloc_context();
+	rec->avctx = avcodec_alloc_context3(rec->codec);
 	if (! rec->avctx)
 		return -ENOMEM;
 
 	rec->avctx->bit_rate = rec->bitrate * 1000;
 	rec->avctx->sample_rate = io->rate;
-	rec->avctx->channels = io->channels;
-#if LIBAVCODEC_VERSION_MAJOR > 52 || (LIBAVCODEC_VERSION_MAJOR == 52 && LIBAVCODEC_VERSION_MINOR >= 3)
-	switch (io->channels) {
-	case 2:
-		rec->avctx->channel_layout = CH_LAYOUT_STEREO;
-		break;
-	case 4:
-		rec->avctx->channel_layout = CH_LAYOUT_QUAD;
-		break;
-	case 6:
-		rec->avctx->channel_layout = CH_LAYOUT_5POINT1;
-		break;
-	default:
-		break;
-	}
-#endif
+	rec->avctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+	a52_set_channel_layout(rec->avctx, io->channels);
 
-	if (avcodec_open(rec->avctx, rec->codec) < 0)
+	if (avcodec_open2(rec->avctx, rec->codec, NULL) < 0)
 		return -EINVAL;
 
-	rec->inbuf = malloc(rec->avctx->frame_size * 2 * io->channels);
-	if (! rec->inbuf)
-		return -ENOMEM;
 	rec->outbuf_size = rec->avctx->frame_size * 4;
-	rec->outbuf = malloc(rec->outbuf_size);
-	if (! rec->outbuf)
-		return -ENOMEM;
-
 	rec->transfer = 0;
 	rec->remain = 0;
+	rec->sent = 0;
 	rec->filled = 0;
 
+	/* the frames and the packet the encoder works on are set up here
+	 * and reused, the data buffers of its packets come from a pool
+	 */
+	blocks = rec->threaded ? A52_RING_SIZE : 1;
+	for (i = 0; i < blocks; i++) {
+		rec->blocks[i] = a52_alloc_block(rec);
+		if (! rec->blocks[i])
+			return -ENOMEM;
+	}
+	rec->frame = rec->blocks[0];
+	rec->pkt = av_packet_alloc();
+	if (! rec->pkt)
+		return -ENOMEM;
+#ifdef A52_ENCODER_BUFFER
+	rec->pkt_pool = av_buffer_pool_init(rec->outbuf_size +
+					    AV_INPUT_BUFFER_PADDING_SIZE,
+					    av_buffer_allocz);
+	if (! rec->pkt_pool)
+		return -ENOMEM;
+	rec->avctx->opaque = rec;
+	rec->avctx->get_encoder_buffer = a52_get_encoder_buffer;
+#endif
+
+	if (rec->threaded) {
+		int err = a52_start_encoder(rec);
+		if (err < 0)
+			return err;
+		return snd_pcm_prepare(rec->slave);
+	}
+
+	rec->outbuf = malloc(rec->outbuf_size);
+	if (! rec->outbuf)
+		return -ENOMEM;
+
 	return snd_pcm_prepare(rec->slave);
 }
 
@@ -513,6 +985,7 @@ static snd_pcm_ioplug_callback_t a52_ops = {
 	.start = a52_start,
 	.stop = a52_stop,
 	.pointer = a52_pointer,
+	.delay = a52_delay,
 	.transfer = a52_transfer,
 	.close = a52_close,
 	.hw_params = a52_hw_params,
@@ -533,8 +1006,6 @@ static snd_pcm_ioplug_callback_t a52_ops = {
  * of the slave PCM
  */
 
-#define A52_FRAME_SIZE	1536
-
 #define ARRAY_SIZE(ary)	(sizeof(ary)/sizeof(ary[0]))
 
 static int a52_set_hw_constraint(struct a52_ctx *rec)
@@ -545,10 +1016,15 @@ static int a52_set_hw_constraint(struct a52_ctx *rec)
 		SND_PCM_ACCESS_RW_INTERLEAVED,
 		SND_PCM_ACCESS_RW_NONINTERLEAVED
 	};
-	unsigned int formats[] = { SND_PCM_FORMAT_S16 };
+	/* all go to the encoder as float without a stop at S16 */
+	unsigned int formats[] = {
+		SND_PCM_FORMAT_S16,
+		SND_PCM_FORMAT_S32,
+		SND_PCM_FORMAT_FLOAT
+	};
 	int err;
 	snd_pcm_uframes_t buffer_max;
-	unsigned int period_bytes, max_periods;
+	unsigned int period_bytes[2], max_periods;
 
 	if ((err = snd_pcm_ioplug_set_param_list(&rec->io, SND_PCM_IOPLUG_HW_ACCESS,
 						 ARRAY_SIZE(accesses), accesses)) < 0 ||
@@ -564,11 +1040,19 @@ static int a52_set_hw_constraint(struct a52_ctx *rec)
 		return err;
 
 	snd_pcm_hw_params_get_buffer_size_max(rec->hw_params, &buffer_max);
-	period_bytes = A52_FRAME_SIZE * 2 * rec->channels;
-	max_periods = buffer_max / A52_FRAME_SIZE;
-
-	if ((err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
-						   period_bytes, period_bytes)) < 0 ||
+	/* One A52 frame of 16 or 32-bit samples.  ioplug can't tie the
+	 * period bytes to the format, so both sizes are offered for every
+	 * format: S16 also gets two A52 frames (3072), S32/FLOAT half of
+	 * one (768).  Either works, fill_data collects whole blocks from
+	 * any period size.  The periods are counted for the longer one so
+	 * the buffer stays within the slave's.
+	 */
+	period_bytes[0] = A52_FRAME_SIZE * 2 * rec->channels;
+	period_bytes[1] = A52_FRAME_SIZE * 4 * rec->channels;
+	max_periods = buffer_max / (A52_FRAME_SIZE * 2);
+
+	if ((err = snd_pcm_ioplug_set_param_list(&rec->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+						 ARRAY_SIZE(period_bytes), period_bytes)) < 0 ||
 	    (err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_PERIODS,
 						   2, max_periods)) < 0)
 		return err;
@@ -589,6 +1073,7 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 	unsigned int bitrate = 448;
 	unsigned int channels = 6;
 	snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+	int threaded = 0;
 	char devstr[128], tmpcard[8];
 	struct a52_ctx *rec;
 	
@@ -682,6 +1167,13 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 			}
 			continue;
 		}
+		if (strcmp(id, "threaded") == 0) {
+			if ((threaded = snd_config_get_bool(n)) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
 		SNDERR("Unknown field %s", id);
 		return -EINVAL;
 	}
@@ -696,10 +1188,13 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 	rec->bitrate = bitrate;
 	rec->channels = channels;
 	rec->format = format;
+	rec->threaded = threaded;
+	rec->iec958_frame = a52_get_iec958_frame();
 
-	avcodec_init();
+#if LIBAVCODEC_VERSION_MAJOR < 58
 	avcodec_register_all();
-	rec->codec = avcodec_find_encoder(CODEC_ID_AC3);
+#endif
+	rec->codec = avcodec_find_encoder(AV_CODEC_ID_AC3);
 	if (! rec->codec) {
 		SNDERR("Cannot find codec engine");
 		err = -EINVAL;
@@ -20,15 +20,19 @@
 
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
+#include "vdownmix_fir.h"
 
 /* #define I_AM_POWERFUL */
 
+/* samples of history kept per channel, longer than the longest delay */
 #ifdef I_AM_POWERFUL
-#define RINGBUF_SIZE	(1 << 9)
+#define HISTORY_SIZE	(1 << 9)
 #else
-#define RINGBUF_SIZE	(1 << 7)
+#define HISTORY_SIZE	(1 << 7)
 #endif
-#define RINGBUF_MASK	(RINGBUF_SIZE - 1)
+
+/* frames filtered at once */
+#define BLOCK_SIZE	256
 
 struct vdownmix_tap {
 	int delay;
@@ -45,8 +49,10 @@ struct vdownmix_filter {
 typedef struct {
 	snd_pcm_extplug_t ext;
 	int channels;
-	unsigned int curpos;
-	short rbuf[RINGBUF_SIZE][5];
+	vdownmix_fir_t fir;
+	struct vdownmix_fir filters[5];
+	/* per channel, the history followed by the block being filtered */
+	short hist[5][HISTORY_SIZE + BLOCK_SIZE];
 } snd_pcm_vdownmix_t;
 
 static const struct vdownmix_filter tap_filters[5] = {
@@ -218,9 +224,10 @@ vdownmix_transfer(snd_pcm_extplug_t *ext,
 	snd_pcm_vdownmix_t *mix = (snd_pcm_vdownmix_t *)ext;
 	short *src[mix->channels], *ptr[2];
 	unsigned int src_step[mix->channels], step[2];
-	int i, ch, curpos, p, idx;
-	int acc[2];
-	int fr;
+	int acc[2][BLOCK_SIZE];
+	unsigned int i, n;
+	int ch, idx;
+	snd_pcm_uframes_t fr;
 
 	ptr[0] = area_addr(dst_areas, dst_offset);
 	step[0] = area_step(dst_areas) / 2;
@@ -231,37 +238,36 @@ vdownmix_transfer(snd_pcm_extplug_t *ext,
 		src[ch] = area_addr(src_area, src_offset);
 		src_step[ch] = area_step(src_area) / 2;
 	}
-	curpos = mix->curpos;
-	fr = size;
-	while (fr--) {
-		acc[0] = acc[1] = 0;
+	for (fr = size; fr; fr -= n) {
+		n = fr < BLOCK_SIZE ? fr : BLOCK_SIZE;
+		memset(acc[0], 0, n * sizeof(int));
+		memset(acc[1], 0, n * sizeof(int));
 		for (ch = 0; ch < mix->channels; ch++) {
-			mix->rbuf[curpos][ch] = *src[ch];
-			for (idx = 0; idx < 2; idx++) {
-				int f = tap_index[ch][idx];
-				const struct vdownmix_filter *filter;
-				filter = &tap_filters[f];
-				for (i = 0; i < filter->taps; i++) {
-					p = (curpos + RINGBUF_SIZE - filter->tap[i].delay)
-						& RINGBUF_MASK;
-					acc[idx] += mix->rbuf[p][ch] * filter->tap[i].weight;
-				}
+			short *x = mix->hist[ch] + HISTORY_SIZE;
+			for (i = 0; i < n; i++) {
+				x[i] = *src[ch];
+				src[ch] += src_step[ch];
 			}
-			src[ch] += src_step[ch];
+			for (idx = 0; idx < 2; idx++)
+				mix->fir(acc[idx], x,
+					 &mix->filters[tap_index[ch][idx]], n);
+			/* the end of the block is the next block's history */
+			memmove(mix->hist[ch], mix->hist[ch] + n,
+				HISTORY_SIZE * sizeof(short));
 		}
 		for (idx = 0; idx < 2; idx++) {
-			acc[idx] >>= 14;
-			if (acc[idx] < -32768)
-				*ptr[idx] = -32768;
-			else if (acc[idx] > 32767)
-				*ptr[idx] = 32767;
-			else
-				*ptr[idx] = acc[idx];
-			ptr[idx] += step[idx];
+			for (i = 0; i < n; i++) {
+				int val = acc[idx][i] >> 14;
+				if (val < -32768)
+					*ptr[idx] = -32768;
+				else if (val > 32767)
+					*ptr[idx] = 32767;
+				else
+					*ptr[idx] = val;
+				ptr[idx] += step[idx];
+			}
 		}
-		curpos = (curpos + 1) & RINGBUF_MASK;
 	}
-	mix->curpos = curpos;
 	return size;
 }
 
@@ -269,11 +275,22 @@ vdownmix_transfer(snd_pcm_extplug_t *ext,
 static int vdownmix_init(snd_pcm_extplug_t *ext)
 {
 	snd_pcm_vdownmix_t *mix = (snd_pcm_vdownmix_t *)ext;
+	int delay[MAX_TAPS], weight[MAX_TAPS];
+	int f, i;
+
 	mix->channels = ext->channels;
 	if (mix->channels > 5) /* ignore LFE */
 		mix->channels = 5;
-	mix->curpos = 0;
-	memset(mix->rbuf, 0, sizeof(mix->rbuf));
+	for (f = 0; f < 5; f++) {
+		for (i = 0; i < tap_filters[f].taps; i++) {
+			delay[i] = tap_filters[f].tap[i].delay;
+			weight[i] = tap_filters[f].tap[i].weight;
+		}
+		vdownmix_fir_setup(&mix->filters[f], tap_filters[f].taps,
+				   delay, weight);
+	}
+	mix->fir = vdownmix_get_fir();
+	memset(mix->hist, 0, sizeof(mix->hist));
 	return 0;
 }
 
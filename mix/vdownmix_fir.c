@@ -0,0 +1,177 @@
+/*
+ * Sparse FIR filters for the vdownmix plugin
+ *
+ * The filters run over a block of samples at a time.  The SIMD versions
+ * compute 8 or 16 outputs at once, keeping them in registers over all
+ * taps, and feed two taps per pmaddwd (SSE2/AVX2) or one per vmlal
+ * (NEON).  The sums are the same 32-bit integers as in the C version.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <string.h>
+#include "vdownmix_fir.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_FIR
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+void vdownmix_fir_setup(struct vdownmix_fir *fir, int taps,
+			const int *delay, const int *weight)
+{
+	int i;
+
+	memset(fir, 0, sizeof(*fir));
+	for (i = 0; i < taps && i < FIR_MAX_TAPS; i++) {
+		fir->delay[i] = delay[i];
+		fir->weight[i] = weight[i];
+	}
+	fir->taps = i;
+	if (fir->taps & 1) {
+		/* a zero tap at a delay that is read anyway */
+		fir->delay[fir->taps] = fir->delay[fir->taps - 1];
+		fir->weight[fir->taps] = 0;
+		fir->taps++;
+	}
+	for (i = 0; i < fir->taps; i += 2)
+		fir->pair[i / 2] = (unsigned short)fir->weight[i] |
+			((unsigned int)(unsigned short)fir->weight[i + 1] << 16);
+}
+
+/* the outputs from t on, also the tails of the SIMD versions */
+static void fir_c(int *acc, const short *x, const struct vdownmix_fir *fir,
+		  unsigned int t, unsigned int n)
+{
+	int k;
+
+	for (; t < n; t++) {
+		int sum = acc[t];
+		for (k = 0; k < fir->taps; k++)
+			sum += x[(int)t - fir->delay[k]] * fir->weight[k];
+		acc[t] = sum;
+	}
+}
+
+void vdownmix_fir_c(int *acc, const short *x,
+		    const struct vdownmix_fir *fir, unsigned int n)
+{
+	fir_c(acc, x, fir, 0, n);
+}
+
+#if defined(__SSE2__)
+static void vdownmix_fir_sse2(int *acc, const short *x,
+			      const struct vdownmix_fir *fir, unsigned int n)
+{
+	unsigned int t;
+	int k;
+
+	for (t = 0; t + 8 <= n; t += 8) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(acc + t));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(acc + t + 4));
+		for (k = 0; k < fir->taps; k += 2) {
+			__m128i w = _mm_set1_epi32(fir->pair[k / 2]);
+			__m128i xa = _mm_loadu_si128((const __m128i *)
+						     (x + t - fir->delay[k]));
+			__m128i xb = _mm_loadu_si128((const __m128i *)
+						     (x + t - fir->delay[k + 1]));
+			/* pairs of samples for taps k and k + 1 per output */
+			a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi16(xa, xb), w));
+			a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi16(xa, xb), w));
+		}
+		_mm_storeu_si128((__m128i *)(acc + t), a0);
+		_mm_storeu_si128((__m128i *)(acc + t + 4), a1);
+	}
+	fir_c(acc, x, fir, t, n);
+}
+#endif
+
+#ifdef HAVE_AVX2_FIR
+/* The unpacks work per 128-bit lane, so a0 holds outputs 0-3 and 8-11,
+ * a1 outputs 4-7 and 12-15; the accumulators are loaded and stored in
+ * that order.
+ */
+__attribute__((target("avx2")))
+static void vdownmix_fir_avx2(int *acc, const short *x,
+			      const struct vdownmix_fir *fir, unsigned int n)
+{
+	unsigned int t;
+	int k;
+
+	for (t = 0; t + 16 <= n; t += 16) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(acc + t));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(acc + t + 8));
+		__m256i a0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+		__m256i a1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+		for (k = 0; k < fir->taps; k += 2) {
+			__m256i w = _mm256_set1_epi32(fir->pair[k / 2]);
+			__m256i xa = _mm256_loadu_si256((const __m256i *)
+							(x + t - fir->delay[k]));
+			__m256i xb = _mm256_loadu_si256((const __m256i *)
+							(x + t - fir->delay[k + 1]));
+			a0 = _mm256_add_epi32(a0, _mm256_madd_epi16(_mm256_unpacklo_epi16(xa, xb), w));
+			a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(_mm256_unpackhi_epi16(xa, xb), w));
+		}
+		_mm256_storeu_si256((__m256i *)(acc + t),
+				    _mm256_permute2x128_si256(a0, a1, 0x20));
+		_mm256_storeu_si256((__m256i *)(acc + t + 8),
+				    _mm256_permute2x128_si256(a0, a1, 0x31));
+	}
+	fir_c(acc, x, fir, t, n);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void vdownmix_fir_neon(int *acc, const short *x,
+			      const struct vdownmix_fir *fir, unsigned int n)
+{
+	unsigned int t;
+	int k;
+
+	for (t = 0; t + 8 <= n; t += 8) {
+		int32x4_t a0 = vld1q_s32(acc + t);
+		int32x4_t a1 = vld1q_s32(acc + t + 4);
+		for (k = 0; k < fir->taps; k++) {
+			int16x8_t v = vld1q_s16(x + t - fir->delay[k]);
+			a0 = vmlal_n_s16(a0, vget_low_s16(v), fir->weight[k]);
+			a1 = vmlal_n_s16(a1, vget_high_s16(v), fir->weight[k]);
+		}
+		vst1q_s32(acc + t, a0);
+		vst1q_s32(acc + t + 4, a1);
+	}
+	fir_c(acc, x, fir, t, n);
+}
+#endif
+
+vdownmix_fir_t vdownmix_get_fir(void)
+{
+#ifdef HAVE_AVX2_FIR
+	if (__builtin_cpu_supports("avx2"))
+		return vdownmix_fir_avx2;
+#endif
+#if defined(__SSE2__)
+	return vdownmix_fir_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return vdownmix_fir_neon;
+#else
+	return vdownmix_fir_c;
+#endif
+}
@@ -0,0 +1,56 @@
+/*
+ * Sparse FIR filters for the vdownmix plugin
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __VDOWNMIX_FIR_H
+#define __VDOWNMIX_FIR_H
+
+#define FIR_MAX_TAPS	32
+
+/*
+ * A filter with a few taps at arbitrary delays.  taps is always even,
+ * an odd filter is padded with a zero weight, so that the SIMD versions
+ * can multiply-add two taps at once; pair[] holds weights 2k and 2k+1
+ * in the low and high 16 bits.
+ */
+struct vdownmix_fir {
+	int taps;
+	int delay[FIR_MAX_TAPS];
+	short weight[FIR_MAX_TAPS];
+	int pair[FIR_MAX_TAPS / 2];
+};
+
+/* fill in fir from taps delay/weight pairs; weights must fit in 16 bits */
+void vdownmix_fir_setup(struct vdownmix_fir *fir, int taps,
+			const int *delay, const int *weight);
+
+/*
+ * acc[t] += weight[k] * x[t - delay[k]] over all taps, for t < n.
+ * x[-1] and before is the history; it must reach back to the largest
+ * delay.
+ */
+typedef void (*vdownmix_fir_t)(int *acc, const short *x,
+			       const struct vdownmix_fir *fir, unsigned int n);
+
+/* the fastest implementation this CPU supports */
+vdownmix_fir_t vdownmix_get_fir(void);
+
+/* the plain C version, for comparison */
+void vdownmix_fir_c(int *acc, const short *x,
+		    const struct vdownmix_fir *fir, unsigned int n);
+
+#endif
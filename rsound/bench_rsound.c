@@ -0,0 +1,542 @@
+/*
+ * Loopback benchmark for the ALSA <-> RSound PCM plugin
+ *
+ * A minimal stand-in RSound server runs in a thread on 127.0.0.1 and
+ * consumes the stream either in real time or as fast as it arrives. The
+ * driver opens the rsound PCM through snd_pcm_open and reports throughput,
+ * CPU cost, write latency, delay accuracy and xruns for a set of
+ * period/buffer sizes.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <alsa/asoundlib.h>
+
+#define HEADER_SIZE 44
+#define MAX_CLIENTS 8
+
+/* The stand-in server. It understands the part of the protocol librsound
+ * needs to stream: a WAV header on the data socket, answered with the
+ * backend latency and chunk size. It never offers the extended control
+ * protocol, so the control connection is simply drained. */
+struct bench_server
+{
+   int listen_fd;
+   int port;
+   int realtime;
+   volatile int quit;
+
+   pthread_t thread;
+   pthread_mutex_t lock;
+   uint64_t consumed;   /* bytes consumed in the current session */
+   int frame_bytes;
+   int rate;
+   volatile uint64_t cpu_ns; /* CPU time used by the server thread */
+};
+
+struct bench_result
+{
+   snd_pcm_uframes_t period;
+   snd_pcm_uframes_t buffer;
+   double wall;
+   double audio;
+   double cpu;
+   double lat_p50;
+   double lat_p99;
+   double delay_err_mean;
+   double delay_err_max;
+   unsigned int xruns;
+};
+
+static uint64_t now_ns(clockid_t clk)
+{
+   struct timespec ts;
+   clock_gettime(clk, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+   return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int server_handshake(struct bench_server *srv, int fd)
+{
+   unsigned char header[HEADER_SIZE];
+   uint32_t reply[2];
+   size_t got = 0;
+
+   while ( got < HEADER_SIZE )
+   {
+      ssize_t rc = recv(fd, header + got, HEADER_SIZE - got, 0);
+      if ( rc <= 0 )
+         return -1;
+      got += rc;
+   }
+
+   pthread_mutex_lock(&srv->lock);
+   srv->frame_bytes = get_le16(header + 22) * (get_le16(header + 34) / 8);
+   srv->rate = get_le32(header + 24);
+   srv->consumed = 0;
+   pthread_mutex_unlock(&srv->lock);
+
+   /* No backend latency, and a small chunk size. */
+   reply[0] = htonl(0);
+   reply[1] = htonl(512);
+   if ( send(fd, reply, sizeof(reply), 0) != sizeof(reply) )
+      return -1;
+
+   return 0;
+}
+
+static void *server_thread(void *data)
+{
+   struct bench_server *srv = data;
+   struct pollfd fds[MAX_CLIENTS + 1];
+   int is_data[MAX_CLIENTS + 1];
+   int nfds = 1;
+   uint64_t start = 0;
+   static char scratch[1 << 16];
+
+   fds[0].fd = srv->listen_fd;
+   fds[0].events = POLLIN;
+
+   while ( !srv->quit )
+   {
+      int timeout = 100;
+      int i;
+
+      for ( i = 1; i < nfds; i++ )
+      {
+         fds[i].events = POLLIN;
+
+         /* In real time mode, don't read ahead of the sample clock. */
+         if ( is_data[i] == 2 && srv->realtime && start )
+         {
+            uint64_t due = (now_ns(CLOCK_MONOTONIC) - start) *
+               srv->rate / 1000000000ULL * srv->frame_bytes;
+            if ( due <= srv->consumed )
+            {
+               fds[i].events = 0;
+               timeout = 1;
+            }
+         }
+      }
+
+      if ( poll(fds, nfds, timeout) < 0 )
+         break;
+
+      if ( (fds[0].revents & POLLIN) && nfds <= MAX_CLIENTS )
+      {
+         int fd = accept(srv->listen_fd, NULL, NULL);
+         if ( fd >= 0 )
+         {
+            fds[nfds].fd = fd;
+            fds[nfds].revents = 0;
+            is_data[nfds] = 0;
+            nfds++;
+         }
+      }
+
+      for ( i = 1; i < nfds; i++ )
+      {
+         char magic[4];
+         ssize_t rc;
+
+         if ( !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) )
+            continue;
+
+         /* A new connection is the data socket if it starts with RIFF. */
+         if ( is_data[i] == 0 )
+         {
+            rc = recv(fds[i].fd, magic, sizeof(magic), MSG_PEEK);
+            if ( rc == sizeof(magic) && memcmp(magic, "RIFF", 4) == 0 )
+            {
+               if ( server_handshake(srv, fds[i].fd) < 0 )
+                  rc = 0;
+               else
+               {
+                  is_data[i] = 2;
+                  start = 0;
+                  continue;
+               }
+            }
+            else if ( rc > 0 )
+               is_data[i] = 1;
+         }
+
+         if ( is_data[i] != 0 )
+         {
+            size_t len = sizeof(scratch);
+
+            if ( is_data[i] == 2 && srv->realtime && start )
+            {
+               uint64_t due = (now_ns(CLOCK_MONOTONIC) - start) *
+                  srv->rate / 1000000000ULL * srv->frame_bytes;
+               if ( due <= srv->consumed )
+                  continue;
+               if ( due - srv->consumed < len )
+                  len = due - srv->consumed;
+            }
+
+            rc = recv(fds[i].fd, scratch, len, 0);
+            if ( rc > 0 && is_data[i] == 2 )
+            {
+               if ( !start )
+                  start = now_ns(CLOCK_MONOTONIC);
+               pthread_mutex_lock(&srv->lock);
+               srv->consumed += rc;
+               pthread_mutex_unlock(&srv->lock);
+            }
+         }
+
+         if ( rc <= 0 )
+         {
+            close(fds[i].fd);
+            fds[i] = fds[nfds - 1];
+            is_data[i] = is_data[nfds - 1];
+            nfds--;
+            i--;
+         }
+      }
+
+      srv->cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID);
+   }
+
+   while ( nfds > 1 )
+      close(fds[--nfds].fd);
+
+   return NULL;
+}
+
+static int server_start(struct bench_server *srv)
+{
+   struct sockaddr_in addr;
+   socklen_t len = sizeof(addr);
+   int one = 1;
+
+   srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+   if ( srv->listen_fd < 0 )
+      return -1;
+   setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   addr.sin_port = 0;
+   if ( bind(srv->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+         listen(srv->listen_fd, MAX_CLIENTS) < 0 ||
+         getsockname(srv->listen_fd, (struct sockaddr*)&addr, &len) < 0 )
+   {
+      close(srv->listen_fd);
+      return -1;
+   }
+   srv->port = ntohs(addr.sin_port);
+
+   pthread_mutex_init(&srv->lock, NULL);
+   if ( pthread_create(&srv->thread, NULL, server_thread, srv) != 0 )
+   {
+      close(srv->listen_fd);
+      return -1;
+   }
+   return 0;
+}
+
+static void server_stop(struct bench_server *srv)
+{
+   srv->quit = 1;
+   pthread_join(srv->thread, NULL);
+   close(srv->listen_fd);
+   pthread_mutex_destroy(&srv->lock);
+}
+
+static uint64_t server_consumed(struct bench_server *srv)
+{
+   uint64_t ret;
+   pthread_mutex_lock(&srv->lock);
+   ret = srv->consumed;
+   pthread_mutex_unlock(&srv->lock);
+   return ret;
+}
+
+/* Builds a local config defining pcm.bench on top of the server, so the
+ * plugin is opened through the regular snd_pcm_open path. */
+static int open_pcm(snd_pcm_t **pcm, int port, const char *lib)
+{
+   char buf[1024];
+   snd_config_t *conf;
+   snd_input_t *in;
+   int err;
+
+   snprintf(buf, sizeof(buf),
+         "%s%s%s"
+         "pcm.bench { type rsound host \"127.0.0.1\" port \"%d\" }\n",
+         lib ? "pcm_type.rsound { lib \"" : "",
+         lib ? lib : "",
+         lib ? "\" }\n" : "",
+         port);
+
+   if ( (err = snd_config_top(&conf)) < 0 )
+      return err;
+   if ( (err = snd_input_buffer_open(&in, buf, -1)) < 0 )
+   {
+      snd_config_delete(conf);
+      return err;
+   }
+   err = snd_config_load(conf, in);
+   snd_input_close(in);
+   if ( err >= 0 )
+      err = snd_pcm_open_lconf(pcm, "bench", SND_PCM_STREAM_PLAYBACK, 0, conf);
+   snd_config_delete(conf);
+   return err;
+}
+
+static int set_params(snd_pcm_t *pcm, unsigned int rate, unsigned int channels,
+      snd_pcm_uframes_t *period, snd_pcm_uframes_t *buffer)
+{
+   snd_pcm_hw_params_t *hw;
+   int err;
+
+   snd_pcm_hw_params_alloca(&hw);
+   if ( (err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+         (err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+         (err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16_LE)) < 0 ||
+         (err = snd_pcm_hw_params_set_channels(pcm, hw, channels)) < 0 ||
+         (err = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0)) < 0 ||
+         (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, period, NULL)) < 0 ||
+         (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, buffer)) < 0 ||
+         (err = snd_pcm_hw_params(pcm, hw)) < 0 )
+      return err;
+   return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+   return x < y ? -1 : x > y;
+}
+
+static int run_one(struct bench_server *srv, const char *lib,
+      unsigned int rate, unsigned int channels, double seconds,
+      struct bench_result *res)
+{
+   snd_pcm_t *pcm;
+   int16_t *buf;
+   uint64_t *lat;
+   uint64_t frames = 0, total = seconds * rate;
+   uint64_t t0, cpu0, srv_cpu0;
+   unsigned int i, n = 0, samples = 0, max_writes;
+   double err_sum = 0.0;
+   int err;
+
+   if ( (err = open_pcm(&pcm, srv->port, lib)) < 0 )
+   {
+      fprintf(stderr, "Cannot open rsound PCM: %s\n", snd_strerror(err));
+      return err;
+   }
+   if ( (err = set_params(pcm, rate, channels, &res->period, &res->buffer)) < 0 )
+   {
+      fprintf(stderr, "Cannot set hw params: %s\n", snd_strerror(err));
+      snd_pcm_close(pcm);
+      return err;
+   }
+
+   buf = malloc(res->period * channels * sizeof(*buf));
+   max_writes = total / res->period + 1;
+   lat = malloc(max_writes * sizeof(*lat));
+   if ( !buf || !lat )
+   {
+      free(buf);
+      free(lat);
+      snd_pcm_close(pcm);
+      return -ENOMEM;
+   }
+   for ( i = 0; i < res->period * channels; i++ )
+      buf[i] = (int16_t)((i * 97) & 0x3fff);
+
+   res->xruns = 0;
+   res->delay_err_max = 0.0;
+   srv_cpu0 = srv->cpu_ns;
+   t0 = now_ns(CLOCK_MONOTONIC);
+   cpu0 = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+   while ( frames < total && n < max_writes )
+   {
+      snd_pcm_sframes_t rc, delay;
+      uint64_t w0 = now_ns(CLOCK_MONOTONIC);
+
+      rc = snd_pcm_writei(pcm, buf, res->period);
+      lat[n++] = now_ns(CLOCK_MONOTONIC) - w0;
+
+      if ( rc == -EPIPE )
+      {
+         res->xruns++;
+         snd_pcm_prepare(pcm);
+         continue;
+      }
+      if ( rc < 0 )
+      {
+         fprintf(stderr, "Write failed: %s\n", snd_strerror(rc));
+         break;
+      }
+      frames += rc;
+
+      /* The true delay is what the client has written minus what the
+       * server has consumed. */
+      if ( snd_pcm_delay(pcm, &delay) == 0 )
+      {
+         double truth = (double)frames - server_consumed(srv) / (2.0 * channels);
+         double diff = ((double)delay - truth) * 1000.0 / rate;
+         if ( diff < 0 )
+            diff = -diff;
+         err_sum += diff;
+         if ( diff > res->delay_err_max )
+            res->delay_err_max = diff;
+         samples++;
+      }
+   }
+
+   snd_pcm_drain(pcm);
+   res->wall = (now_ns(CLOCK_MONOTONIC) - t0) / 1e9;
+   snd_pcm_close(pcm);
+
+   /* Leave out the server thread, only the plugin and librsound count. */
+   res->cpu = (now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu0 - (srv->cpu_ns - srv_cpu0)) / 1e9;
+   res->audio = (double)frames / rate;
+
+   qsort(lat, n, sizeof(*lat), cmp_u64);
+   res->lat_p50 = n ? lat[n / 2] / 1e3 : 0.0;
+   res->lat_p99 = n ? lat[(n * 99) / 100] / 1e3 : 0.0;
+   res->delay_err_mean = samples ? err_sum / samples : 0.0;
+
+   free(buf);
+   free(lat);
+   return 0;
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr,
+         "Usage: %s [options]\n"
+         "  -r rate       sample rate (default 48000)\n"
+         "  -c channels   channels (default 2)\n"
+         "  -s seconds    seconds of audio per run (default 5)\n"
+         "  -u            server consumes as fast as possible\n"
+         "  -p list       period:buffer frame pairs, comma separated\n"
+         "                (default 64:1024,256:2048,1024:8192,4096:32768)\n"
+         "  -l path       plugin library to load instead of the installed one\n",
+         prog);
+}
+
+int main(int argc, char *argv[])
+{
+   struct bench_server srv;
+   unsigned int rate = 48000, channels = 2;
+   double seconds = 5.0;
+   const char *list = "64:1024,256:2048,1024:8192,4096:32768";
+   const char *lib = NULL;
+   char *sizes, *tok, *save = NULL;
+   int c;
+
+   memset(&srv, 0, sizeof(srv));
+   srv.realtime = 1;
+
+   while ( (c = getopt(argc, argv, "r:c:s:up:l:h")) != -1 )
+   {
+      switch ( c )
+      {
+         case 'r':
+            rate = atoi(optarg);
+            break;
+         case 'c':
+            channels = atoi(optarg);
+            break;
+         case 's':
+            seconds = atof(optarg);
+            break;
+         case 'u':
+            srv.realtime = 0;
+            break;
+         case 'p':
+            list = optarg;
+            break;
+         case 'l':
+            lib = optarg;
+            break;
+         default:
+            usage(argv[0]);
+            return 1;
+      }
+   }
+
+   if ( server_start(&srv) < 0 )
+   {
+      perror("server");
+      return 1;
+   }
+
+   printf("# %u Hz, %u ch, S16_LE, %.1f s per run, %s server on port %d\n",
+         rate, channels, seconds, srv.realtime ? "real-time" : "unlimited", srv.port);
+   printf("# %7s %7s %12s %10s %9s %9s %10s %10s %6s\n",
+         "period", "buffer", "frames/s", "cpu/s", "p50 us", "p99 us",
+         "dly err ms", "dly max ms", "xruns");
+
+   sizes = strdup(list);
+   for ( tok = strtok_r(sizes, ",", &save); tok; tok = strtok_r(NULL, ",", &save) )
+   {
+      struct bench_result res;
+      unsigned long period, buffer;
+
+      if ( sscanf(tok, "%lu:%lu", &period, &buffer) != 2 )
+      {
+         fprintf(stderr, "Invalid size pair %s\n", tok);
+         continue;
+      }
+      memset(&res, 0, sizeof(res));
+      res.period = period;
+      res.buffer = buffer;
+
+      if ( run_one(&srv, lib, rate, channels, seconds, &res) < 0 )
+         continue;
+
+      printf("  %7lu %7lu %12.0f %10.4f %9.1f %9.1f %10.3f %10.3f %6u\n",
+            res.period, res.buffer,
+            res.wall > 0 ? res.audio * rate / res.wall : 0.0,
+            res.audio > 0 ? res.cpu / res.audio : 0.0,
+            res.lat_p50, res.lat_p99,
+            res.delay_err_mean, res.delay_err_max, res.xruns);
+   }
+   free(sizes);
+
+   server_stop(&srv);
+   return 0;
+}
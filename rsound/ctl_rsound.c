@@ -0,0 +1,308 @@
+/*
+ * ALSA <-> RSound statistics control plugin
+ *
+ * Shows the counters of RSound PCM streams opened with "stats true" as
+ * read-only controls, one set per stream. The streams are found through
+ * their shared memory segments in /dev/shm.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <alsa/asoundlib.h>
+#include <alsa/control_external.h>
+#include "rsound_stats.h"
+
+#define RSOUND_CTL_MAX_STREAMS 32
+
+enum
+{
+   RSOUND_CTL_BYTES_SENT = 0,
+   RSOUND_CTL_SHORT_WRITES,
+   RSOUND_CTL_WRITE_FAILURES,
+   RSOUND_CTL_RESTARTS,
+   RSOUND_CTL_WRITE_LATENCY,
+   RSOUND_CTL_ELEMS
+};
+
+static const char * const rsound_ctl_names[RSOUND_CTL_ELEMS] = {
+   "Bytes Sent",
+   "Short Writes",
+   "Write Failures",
+   "Restarts",
+   "Write Latency Log2 us"
+};
+
+struct rsound_ctl_stream
+{
+   char id[32]; /* <pid>.<n> */
+   const struct rsound_stats *stats;
+};
+
+typedef struct snd_ctl_rsound
+{
+   snd_ctl_ext_t ext;
+   unsigned int num_streams;
+   struct rsound_ctl_stream streams[RSOUND_CTL_MAX_STREAMS];
+} snd_ctl_rsound_t;
+
+static void rsound_ctl_unmap(snd_ctl_rsound_t *ctl)
+{
+   unsigned int i;
+
+   for ( i = 0; i < ctl->num_streams; i++ )
+      munmap((void*)ctl->streams[i].stats, sizeof(struct rsound_stats));
+   ctl->num_streams = 0;
+}
+
+static const struct rsound_stats *rsound_ctl_map(const char *file)
+{
+   char path[NAME_MAX + 2];
+   struct rsound_stats *stats;
+   struct stat st;
+   int fd;
+
+   snprintf(path, sizeof(path), "/%s", file);
+   fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+   if ( fd < 0 )
+      return NULL;
+   if ( fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*stats) )
+   {
+      close(fd);
+      return NULL;
+   }
+   stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if ( stats == MAP_FAILED )
+      return NULL;
+
+   /* Segments left behind by a crashed process are skipped. */
+   if ( stats->magic != RSOUND_STATS_MAGIC || stats->version != RSOUND_STATS_VERSION ||
+         (kill(stats->pid, 0) < 0 && errno == ESRCH) )
+   {
+      munmap(stats, sizeof(*stats));
+      return NULL;
+   }
+
+   return stats;
+}
+
+/* Builds the stream list anew. The control set follows the streams that
+ * exist each time it is enumerated. */
+static void rsound_ctl_scan(snd_ctl_rsound_t *ctl)
+{
+   DIR *dir;
+   struct dirent *ent;
+   size_t len = strlen(RSOUND_STATS_PREFIX);
+
+   rsound_ctl_unmap(ctl);
+
+   dir = opendir("/dev/shm");
+   if ( !dir )
+      return;
+
+   while ( (ent = readdir(dir)) && ctl->num_streams < RSOUND_CTL_MAX_STREAMS )
+   {
+      struct rsound_ctl_stream *s = &ctl->streams[ctl->num_streams];
+
+      if ( strncmp(ent->d_name, RSOUND_STATS_PREFIX, len) != 0 )
+         continue;
+      if ( !(s->stats = rsound_ctl_map(ent->d_name)) )
+         continue;
+      snprintf(s->id, sizeof(s->id), "%s", ent->d_name + len);
+      ctl->num_streams++;
+   }
+   closedir(dir);
+}
+
+static void rsound_ctl_close(snd_ctl_ext_t *ext)
+{
+   snd_ctl_rsound_t *ctl = ext->private_data;
+
+   rsound_ctl_unmap(ctl);
+   free(ctl);
+}
+
+static int rsound_ctl_elem_count(snd_ctl_ext_t *ext)
+{
+   snd_ctl_rsound_t *ctl = ext->private_data;
+
+   rsound_ctl_scan(ctl);
+   return ctl->num_streams * RSOUND_CTL_ELEMS;
+}
+
+static int rsound_ctl_elem_list(snd_ctl_ext_t *ext, unsigned int offset, snd_ctl_elem_id_t *id)
+{
+   snd_ctl_rsound_t *ctl = ext->private_data;
+   unsigned int stream = offset / RSOUND_CTL_ELEMS;
+   char name[64];
+
+   if ( stream >= ctl->num_streams )
+      return -EINVAL;
+
+   snprintf(name, sizeof(name), "RSound %s %s", ctl->streams[stream].id,
+         rsound_ctl_names[offset % RSOUND_CTL_ELEMS]);
+   snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
+   snd_ctl_elem_id_set_name(id, name);
+   return 0;
+}
+
+static snd_ctl_ext_key_t rsound_ctl_find_elem(snd_ctl_ext_t *ext, const snd_ctl_elem_id_t *id)
+{
+   snd_ctl_rsound_t *ctl = ext->private_data;
+   unsigned int numid = snd_ctl_elem_id_get_numid(id);
+   const char *name = snd_ctl_elem_id_get_name(id);
+   unsigned int i, j;
+   char buf[64];
+
+   if ( numid > 0 && numid <= ctl->num_streams * RSOUND_CTL_ELEMS )
+      return numid - 1;
+
+   for ( i = 0; i < ctl->num_streams; i++ )
+   {
+      for ( j = 0; j < RSOUND_CTL_ELEMS; j++ )
+      {
+         snprintf(buf, sizeof(buf), "RSound %s %s", ctl->streams[i].id, rsound_ctl_names[j]);
+         if ( strcmp(buf, name) == 0 )
+            return i * RSOUND_CTL_ELEMS + j;
+      }
+   }
+
+   return SND_CTL_EXT_KEY_NOT_FOUND;
+}
+
+static int rsound_ctl_get_attribute(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
+      int *type, unsigned int *acc, unsigned int *count)
+{
+   snd_ctl_rsound_t *ctl = ext->private_data;
+
+   if ( key >= ctl->num_streams * RSOUND_CTL_ELEMS )
+      return -EINVAL;
+
+   *type = SND_CTL_ELEM_TYPE_INTEGER64;
+   *acc = SND_CTL_EXT_ACCESS_READ | SND_CTL_EXT_ACCESS_VOLATILE;
+   *count = key % RSOUND_CTL_ELEMS == RSOUND_CTL_WRITE_LATENCY ? RSOUND_STATS_BUCKETS : 1;
+   return 0;
+}
+
+static int rsound_ctl_get_integer64_info(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
+      int64_t *imin, int64_t *imax, int64_t *istep)
+{
+   (void)ext;
+   (void)key;
+
+   *imin = 0;
+   *imax = INT64_MAX;
+   *istep = 0;
+   return 0;
+}
+
+static int rsound_ctl_read_integer64(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, int64_t *value)
+{
+   snd_ctl_rsound_t *ctl = ext->private_data;
+   const struct rsound_stats *stats;
+   unsigned int i;
+
+   if ( key >= ctl->num_streams * RSOUND_CTL_ELEMS )
+      return -EINVAL;
+   stats = ctl->streams[key / RSOUND_CTL_ELEMS].stats;
+
+   switch ( key % RSOUND_CTL_ELEMS )
+   {
+      case RSOUND_CTL_BYTES_SENT:
+         *value = RSOUND_STATS_GET(stats, bytes_sent);
+         break;
+      case RSOUND_CTL_SHORT_WRITES:
+         *value = RSOUND_STATS_GET(stats, short_writes);
+         break;
+      case RSOUND_CTL_WRITE_FAILURES:
+         *value = RSOUND_STATS_GET(stats, write_failures);
+         break;
+      case RSOUND_CTL_RESTARTS:
+         *value = RSOUND_STATS_GET(stats, restarts);
+         break;
+      case RSOUND_CTL_WRITE_LATENCY:
+         for ( i = 0; i < RSOUND_STATS_BUCKETS; i++ )
+            value[i] = RSOUND_STATS_GET(stats, write_latency[i]);
+         break;
+   }
+
+   return 0;
+}
+
+static const snd_ctl_ext_callback_t rsound_ctl_callback = {
+   .close = rsound_ctl_close,
+   .elem_count = rsound_ctl_elem_count,
+   .elem_list = rsound_ctl_elem_list,
+   .find_elem = rsound_ctl_find_elem,
+   .get_attribute = rsound_ctl_get_attribute,
+   .get_integer64_info = rsound_ctl_get_integer64_info,
+   .read_integer64 = rsound_ctl_read_integer64,
+};
+
+SND_CTL_PLUGIN_DEFINE_FUNC(rsound)
+{
+   (void)root;
+	snd_config_iterator_t i, next;
+   snd_ctl_rsound_t *ctl;
+   int err;
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		const char *id;
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0)
+			continue;
+		SNDERR("Unknown field %s", id);
+		return -EINVAL;
+	}
+
+   ctl = calloc(1, sizeof(*ctl));
+   if ( !ctl )
+      return -ENOMEM;
+
+   ctl->ext.version = SND_CTL_EXT_VERSION;
+   ctl->ext.card_idx = 0;
+   strncpy(ctl->ext.id, "rsound", sizeof(ctl->ext.id) - 1);
+   strncpy(ctl->ext.driver, "RSound plugin", sizeof(ctl->ext.driver) - 1);
+   strncpy(ctl->ext.name, "RSound", sizeof(ctl->ext.name) - 1);
+   strncpy(ctl->ext.longname, "RSound stream statistics", sizeof(ctl->ext.longname) - 1);
+   strncpy(ctl->ext.mixername, "RSound", sizeof(ctl->ext.mixername) - 1);
+   ctl->ext.poll_fd = -1;
+   ctl->ext.callback = &rsound_ctl_callback;
+   ctl->ext.private_data = ctl;
+
+   rsound_ctl_scan(ctl);
+
+   err = snd_ctl_ext_create(&ctl->ext, name, mode);
+   if ( err < 0 )
+   {
+      rsound_ctl_unmap(ctl);
+      free(ctl);
+      return err;
+   }
+
+   *handlep = ctl->ext.handle;
+   return 0;
+}
+
+SND_CTL_PLUGIN_SYMBOL(rsound);
@@ -18,29 +18,1229 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
  */
 
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #define RSD_EXPOSE_STRUCT
 #include <rsound.h>
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
+#include "rsound_convert.h"
+#include "rsound_resample.h"
+#include "rsound_stats.h"
 
+#define RSOUND_MAX_HOSTS 16
+#define RSOUND_CONVERT_SAMPLES 2048
+
+/* Reconnect backoff in ms */
+#define RSOUND_BACKOFF_MIN 100
+#define RSOUND_BACKOFF_MAX 5000
+
+/* Host states in reconnect mode. A host that is down belongs to the
+ * reconnect thread until it marks it as back, after which the stream
+ * flushes the backlog to it and takes it over again. */
+enum
+{
+   RSOUND_HOST_UP = 0,
+   RSOUND_HOST_DOWN,
+   RSOUND_HOST_BACK
+};
+
+/* resume position of a host that fell too far behind and rejoins live */
+#define RSOUND_RESUME_LIVE UINT64_MAX
+
+/* Drift is sampled this often, and only reported once the reference point
+ * is this far back. The first seconds after a start are skipped, the
+ * server is still filling its buffers then. */
+#define RSOUND_DRIFT_INTERVAL 1000000000ULL
+#define RSOUND_DRIFT_SETTLE 2000000000ULL
+#define RSOUND_DRIFT_SPAN 10000000000ULL
+/* Corrected writes whose frames may still be waiting to be played */
+#define RSOUND_OFFSET_MARKS 64
+
+/* Server probes are cached per host:port for this many seconds */
+#define RSOUND_PROBE_TTL 10
+#define RSOUND_PROBE_SLOTS 8
+/* Slowest stream offered, 8 kHz mono 8-bit, in bytes per second */
+#define RSOUND_MIN_BYTE_RATE 8000
+
+/* Each configured host gets its own librsound handle, and with it its own
+ * sender thread. The data is converted once by the ioplug layer and then
+ * handed to every host. */
 typedef struct snd_pcm_rsound
 {
-   rsound_t *rd;
-   snd_pcm_uframes_t last_ptr;
+   rsound_t *rd[RSOUND_MAX_HOSTS];
+   /* The host as configured, for the probe cache and dumps. rd[i]->host
+    * becomes the resolved address once the background job is done. */
+   char *host_name[RSOUND_MAX_HOSTS];
+   unsigned int num_hosts;
+   uint64_t written; /* bytes handed to librsound since start */
+   snd_pcm_uframes_t avail_min;
    snd_pcm_ioplug_t io;
    int frame_bytes;
+
+   /* Formats librsound can't take are converted to S16 in rsound_write,
+    * a cache-sized chunk at a time. frame_bytes is always the wire size. */
+   rsound_convert_t convert;
+   int in_frame_bytes;
+   int16_t convbuf[RSOUND_CONVERT_SAMPLES];
+
+   /* The connection is kept open across stop/prepare/start and only
+    * renegotiated when the stream parameters below change. */
+   int connected;
+   int format;
+   int rate;
+   int channels;
+   int bufsize;
+   size_t latency_bytes; /* the latency target in wire bytes, 0 for none */
+
+   /* Tuning from the config, 0 (or -1 for nodelay) leaves the default. */
+   int latency;   /* target latency in ms, caps what avail reports */
+   int sndbuf;    /* SO_SNDBUF in bytes */
+   int nodelay;   /* TCP_NODELAY on (1) or off (0) */
+   int priority;  /* SCHED_FIFO priority of the librsound sender thread */
+
+   /* Reconnect mode. The last buffer's worth of wire data is kept in
+    * history, so a host that drops out can be resumed from the position
+    * it lost, as long as the outage is shorter than the buffer.
+    *
+    * The reconnect thread only touches rd[i] of a host that is DOWN, moves
+    * it from DOWN to BACK and sets reconnect_running, all under
+    * reconnect_lock. Everything else belongs to the stream. host_state is
+    * the one field both use. While the thread may run, it is only changed
+    * under the lock, and reads without it go through rsound_host_state(). */
+   int reconnect;
+   char *history;
+   size_t history_size;
+   int host_state[RSOUND_MAX_HOSTS];
+   uint64_t resume[RSOUND_MAX_HOSTS];     /* stream position to resume from */
+   uint64_t down_since[RSOUND_MAX_HOSTS]; /* CLOCK_MONOTONIC ns */
+   pthread_t reconnect_thread;
+   pthread_mutex_t reconnect_lock;
+   pthread_cond_t reconnect_cond;
+   int reconnect_running;
+   int reconnect_joinable;
+   int reconnect_quit;
+
+   /* Write coalescing. Small writes are gathered here and handed to
+    * librsound once coalesce bytes are pending, or once the oldest pending
+    * byte has waited coalesce_time ms, whichever comes first. coalesce is
+    * the configured size clamped to the period by hw_params. */
+   char *pending;
+   size_t pending_bytes;
+   size_t coalesce;
+   size_t coalesce_conf;
+   int coalesce_time;
+   uint64_t pending_since; /* CLOCK_MONOTONIC ns */
+
+   int probe;
+   size_t chunk_bytes; /* largest server chunk of the connected stream */
+
+   /* Drift of the server's sample clock against CLOCK_MONOTONIC, from how
+    * much it has played since a reference point. */
+   uint64_t drift_start;    /* ns, when the stream (re)started */
+   uint64_t drift_last;     /* ns, last sample */
+   uint64_t drift_ref_time; /* ns, 0 until the reference is taken */
+   uint64_t drift_ref_pos;  /* bytes played at drift_ref_time */
+   double drift_ppm;
+   int drift_valid;
+
+   /* Drift correction. S16 wire data is resampled by 1 + correct_ppm so
+    * the delay stays at what it was when the reference was taken.
+    * frame_offset is the difference between frames taken from the
+    * application and frames sent. The pointer only applies it to frames
+    * that have played: every corrected write leaves a mark with the sent
+    * frame count it ends at and the offset from then on. */
+   int drift_correct;
+   int correct_active;
+   rsound_resampler_t resampler;
+   int64_t correct_target; /* delay in bytes */
+   double correct_ppm;
+   double correct_integral;
+   int64_t frame_offset;
+   struct { uint64_t sent; int64_t offset; } marks[RSOUND_OFFSET_MARKS];
+   unsigned int marks_head, marks_tail;
+   int64_t played_offset;  /* frame_offset as of the frames played */
+   uint64_t last_pos;      /* last pointer, in application frames */
+   int16_t resbuf[RSOUND_CONVERT_SAMPLES + 64];
+
+   /* Background connect, NULL once it has been waited for */
+   struct rsound_open_job *open_job;
+   int connect_timeout; /* ms */
+
+   /* Points to local_stats, or to shared memory with the stats option */
+   struct rsound_stats *stats;
+   struct rsound_stats local_stats;
+   char stats_name[64];
 } snd_pcm_rsound_t;
 
+static int rsound_host_state(snd_pcm_rsound_t *rsound, unsigned int i)
+{
+   return __atomic_load_n(&rsound->host_state[i], __ATOMIC_ACQUIRE);
+}
+
+static void rsound_set_host_state(snd_pcm_rsound_t *rsound, unsigned int i, int state)
+{
+   __atomic_store_n(&rsound->host_state[i], state, __ATOMIC_RELEASE);
+}
+
+/* What a probe connection learned about a server. The cache is shared by
+ * every PCM opened in the process. */
+struct rsound_probe
+{
+   char key[128];
+   uint64_t time; /* CLOCK_MONOTONIC ns, 0 for an empty slot */
+   uint64_t chunk_ns; /* the server's chunk as time, it scales with the stream */
+};
+
+static struct rsound_probe rsound_probe_cache[RSOUND_PROBE_SLOTS];
+static pthread_mutex_t rsound_probe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Name resolution and the server probe run in a thread started at open.
+ * The job has its own copies of the host names and is freed by whichever
+ * of the PCM and the thread lets go of it last, so a PCM closed while the
+ * resolver hangs doesn't have to wait for it. */
+struct rsound_open_job
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int refs;
+   int done;
+   unsigned int num_hosts;
+   char *host[RSOUND_MAX_HOSTS];
+   char *port[RSOUND_MAX_HOSTS];
+   char addr[RSOUND_MAX_HOSTS][NI_MAXHOST]; /* numeric, empty if unresolved */
+};
+
+static uint64_t rsound_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The RSound handshake has the server answer the stream header with its
+ * backend latency and the chunk size it reads the stream in. There is no
+ * query for rates or channels, the server takes any of those and resamples
+ * or remixes on its own, so the chunk size is what can be learned. A short
+ * S16 stereo stream is opened and closed again for it. Returns the chunk as
+ * time, in ns, or 0 if the server couldn't be reached. */
+static uint64_t rsound_probe_server(const char *host, const char *port)
+{
+   rsound_t *rd;
+   int format = RSD_S16_LE;
+   int rate = 44100;
+   int channels = 2;
+   uint64_t chunk = 0;
+
+   if ( rsd_init(&rd) < 0 )
+      return 0;
+
+   if ( host )
+      rsd_set_param(rd, RSD_HOST, (void*)host);
+   if ( port )
+      rsd_set_param(rd, RSD_PORT, (void*)port);
+   rsd_set_param(rd, RSD_FORMAT, &format);
+   rsd_set_param(rd, RSD_SAMPLERATE, &rate);
+   rsd_set_param(rd, RSD_CHANNELS, &channels);
+
+   if ( rsd_start(rd) == 0 )
+   {
+      chunk = (uint64_t)rd->backend_info.chunk_size * 1000000000ULL /
+         ((uint64_t)rate * channels * 2);
+      rsd_stop(rd);
+   }
+   rsd_free(rd);
+   return chunk;
+}
+
+/* Looks the server up in the probe cache and, unless cached_only is set,
+ * probes it on a miss. Failed probes aren't cached, the server may just not
+ * be up yet. */
+static uint64_t rsound_probe(const char *host, const char *port, int cached_only)
+{
+   char key[sizeof(rsound_probe_cache[0].key)];
+   uint64_t now = rsound_now();
+   uint64_t oldest = UINT64_MAX;
+   uint64_t chunk = 0;
+   int i, slot = 0;
+
+   snprintf(key, sizeof(key), "%s:%s", host ? host : "", port ? port : "");
+
+   pthread_mutex_lock(&rsound_probe_lock);
+   for ( i = 0; i < RSOUND_PROBE_SLOTS; i++ )
+   {
+      struct rsound_probe *p = &rsound_probe_cache[i];
+      if ( p->time && now - p->time < RSOUND_PROBE_TTL * 1000000000ULL &&
+            strcmp(p->key, key) == 0 )
+      {
+         chunk = p->chunk_ns;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&rsound_probe_lock);
+   if ( chunk || cached_only )
+      return chunk;
 
+   /* Not under the lock, a slow server shouldn't hold up other opens. */
+   chunk = rsound_probe_server(host, port);
+   if ( !chunk )
+      return 0;
+
+   pthread_mutex_lock(&rsound_probe_lock);
+   for ( i = 0; i < RSOUND_PROBE_SLOTS; i++ )
+   {
+      struct rsound_probe *p = &rsound_probe_cache[i];
+      if ( strcmp(p->key, key) == 0 )
+      {
+         slot = i;
+         break;
+      }
+      if ( p->time < oldest )
+      {
+         oldest = p->time;
+         slot = i;
+      }
+   }
+   snprintf(rsound_probe_cache[slot].key, sizeof(rsound_probe_cache[slot].key), "%s", key);
+   rsound_probe_cache[slot].time = rsound_now();
+   rsound_probe_cache[slot].chunk_ns = chunk;
+   pthread_mutex_unlock(&rsound_probe_lock);
+
+   return chunk;
+}
+
+static void rsound_open_job_release(struct rsound_open_job *job)
+{
+   unsigned int i;
+   int refs;
+
+   pthread_mutex_lock(&job->lock);
+   refs = --job->refs;
+   pthread_mutex_unlock(&job->lock);
+   if ( refs > 0 )
+      return;
+
+   for ( i = 0; i < job->num_hosts; i++ )
+   {
+      free(job->host[i]);
+      free(job->port[i]);
+   }
+   pthread_mutex_destroy(&job->lock);
+   pthread_cond_destroy(&job->cond);
+   free(job);
+}
+
+static void *rsound_open_thread(void *data)
+{
+   struct rsound_open_job *job = data;
+   unsigned int i;
+
+   for ( i = 0; i < job->num_hosts; i++ )
+   {
+      struct addrinfo hints, *res;
+      char addr[NI_MAXHOST];
+
+      /* Probing first also fills the cache under the configured name. */
+      rsound_probe(job->host[i], job->port[i], 0);
+
+      /* Unix sockets and the librsound default host are left alone. */
+      if ( !job->host[i] || job->host[i][0] == '/' )
+         continue;
+
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if ( getaddrinfo(job->host[i], NULL, &hints, &res) != 0 )
+         continue;
+      if ( getnameinfo(res->ai_addr, res->ai_addrlen, addr, sizeof(addr),
+               NULL, 0, NI_NUMERICHOST) == 0 )
+      {
+         pthread_mutex_lock(&job->lock);
+         strcpy(job->addr[i], addr);
+         pthread_mutex_unlock(&job->lock);
+      }
+      freeaddrinfo(res);
+   }
+
+   pthread_mutex_lock(&job->lock);
+   job->done = 1;
+   pthread_cond_broadcast(&job->cond);
+   pthread_mutex_unlock(&job->lock);
+
+   rsound_open_job_release(job);
+   return NULL;
+}
+
+/* Starts resolving and probing the configured hosts in the background. On
+ * failure the plugin just does everything synchronously as before. */
+static void rsound_open_start(snd_pcm_rsound_t *rsound)
+{
+   struct rsound_open_job *job;
+   pthread_t thread;
+   pthread_attr_t attr;
+   unsigned int i;
+
+   job = calloc(1, sizeof(*job));
+   if ( !job )
+      return;
+   pthread_mutex_init(&job->lock, NULL);
+   pthread_cond_init(&job->cond, NULL);
+   job->refs = 2;
+   job->num_hosts = rsound->num_hosts;
+   for ( i = 0; i < job->num_hosts; i++ )
+   {
+      if ( rsound->host_name[i] )
+         job->host[i] = strdup(rsound->host_name[i]);
+      if ( rsound->rd[i]->port )
+         job->port[i] = strdup(rsound->rd[i]->port);
+   }
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if ( pthread_create(&thread, &attr, rsound_open_thread, job) != 0 )
+   {
+      job->refs = 1;
+      rsound_open_job_release(job);
+      job = NULL;
+   }
+   pthread_attr_destroy(&attr);
+
+   rsound->open_job = job;
+}
+
+/* Waits for the background job for up to connect_timeout ms and points
+ * librsound at the resolved addresses, so rsd_start doesn't resolve again.
+ * Only librsound gets them, the plugin keeps going by host_name. */
+static int rsound_open_wait(snd_pcm_rsound_t *rsound)
+{
+   struct rsound_open_job *job = rsound->open_job;
+   struct timespec ts;
+   unsigned int i;
+   int rc = 0;
+
+   if ( !job )
+      return 0;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec += rsound->connect_timeout / 1000;
+   ts.tv_nsec += (rsound->connect_timeout % 1000) * 1000000L;
+   if ( ts.tv_nsec >= 1000000000L )
+   {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+   }
+
+   pthread_mutex_lock(&job->lock);
+   while ( !job->done && rc == 0 )
+      rc = pthread_cond_timedwait(&job->cond, &job->lock, &ts);
+   if ( !job->done )
+   {
+      pthread_mutex_unlock(&job->lock);
+      SNDERR("Timed out connecting to the RSound server");
+      return -ETIMEDOUT;
+   }
+   pthread_mutex_unlock(&job->lock);
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      if ( job->addr[i][0] )
+         rsd_set_param(rsound->rd[i], RSD_HOST, job->addr[i]);
+   }
 
+   rsound->open_job = NULL;
+   rsound_open_job_release(job);
+   return 0;
+}
+
+/* Moves the counters into a shared memory segment for ctl_rsound. If that
+ * fails they just stay local. */
+static void rsound_stats_share(snd_pcm_rsound_t *rsound)
+{
+   static unsigned int seq;
+   struct rsound_stats *stats;
+   int fd;
+
+   snprintf(rsound->stats_name, sizeof(rsound->stats_name), "/" RSOUND_STATS_PREFIX "%d.%u",
+         (int)getpid(), __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+
+   fd = shm_open(rsound->stats_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+   if ( fd < 0 )
+      goto error;
+   if ( ftruncate(fd, sizeof(*stats)) < 0 )
+   {
+      close(fd);
+      shm_unlink(rsound->stats_name);
+      goto error;
+   }
+   stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if ( stats == MAP_FAILED )
+   {
+      shm_unlink(rsound->stats_name);
+      goto error;
+   }
+
+   memcpy(stats, rsound->stats, sizeof(*stats));
+   rsound->stats = stats;
+   return;
+
+error:
+   SNDERR("Cannot share statistics as %s", rsound->stats_name);
+   rsound->stats_name[0] = '\0';
+}
+
+static void rsound_stats_close(snd_pcm_rsound_t *rsound)
+{
+   if ( !rsound->stats_name[0] )
+      return;
+   munmap(rsound->stats, sizeof(*rsound->stats));
+   shm_unlink(rsound->stats_name);
+   rsound->stats = &rsound->local_stats;
+   rsound->stats_name[0] = '\0';
+}
+
+/* Bytes a host that isn't up still has to get once it is back. */
+static uint64_t rsound_backlog(snd_pcm_rsound_t *rsound, unsigned int i)
+{
+   if ( rsound->resume[i] == RSOUND_RESUME_LIVE )
+      return 0;
+   return rsound->written - rsound->resume[i];
+}
+
+
+static int rsound_get_delay(snd_pcm_rsound_t *rsound);
+
+/* Bytes that can still be queued before the delay reaches the latency
+ * target. */
+static size_t rsound_latency_room(snd_pcm_rsound_t *rsound)
+{
+   int delay = rsound_get_delay(rsound);
+   size_t used = (delay > 0 ? (size_t)delay : 0) + rsound->pending_bytes;
+
+   return used < rsound->latency_bytes ? rsound->latency_bytes - used : 0;
+}
+
+/* The stream can only go as fast as the slowest host, so free space is
+ * the minimum, and queued data and delay are the maximum over all hosts. */
+static size_t rsound_get_avail(snd_pcm_rsound_t *rsound)
+{
+   unsigned int i;
+   size_t avail = (size_t)-1;
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      size_t tmp;
+      if ( rsound_host_state(rsound, i) == RSOUND_HOST_UP )
+         tmp = rsd_get_avail(rsound->rd[i]);
+      else if ( rsound->resume[i] != RSOUND_RESUME_LIVE )
+         tmp = rsound->history_size - rsound_backlog(rsound, i);
+      else
+         continue;
+      if ( tmp < avail )
+         avail = tmp;
+   }
+   if ( avail == (size_t)-1 || avail < rsound->pending_bytes )
+      return 0;
+   avail -= rsound->pending_bytes;
+
+   /* With a latency target, only what keeps the delay below it. */
+   if ( rsound->latency_bytes > 0 )
+   {
+      size_t room = rsound_latency_room(rsound);
+      if ( room < avail )
+         avail = room;
+   }
+   return avail;
+}
+
+/* What poll waits for, avail_min frames or the whole latency target if
+ * that is less, so a large avail_min can't keep the stream from waking.
+ * With probe on, waking for less than the server's chunk doesn't get the
+ * audio out any sooner, so up to half the buffer it waits for a chunk. */
+static size_t rsound_avail_wanted(snd_pcm_rsound_t *rsound)
+{
+   size_t need = rsound->avail_min * rsound->frame_bytes;
+
+   if ( rsound->probe && need < rsound->chunk_bytes )
+   {
+      need = rsound->chunk_bytes;
+      if ( need > (size_t)rsound->bufsize / 2 )
+         need = rsound->bufsize / 2;
+      if ( need < rsound->avail_min * rsound->frame_bytes )
+         need = rsound->avail_min * rsound->frame_bytes;
+   }
+
+   if ( rsound->latency_bytes > 0 && need > rsound->latency_bytes )
+      need = rsound->latency_bytes;
+   return need;
+}
+
+static size_t rsound_get_pointer(snd_pcm_rsound_t *rsound)
+{
+   unsigned int i;
+   size_t ptr = 0;
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      size_t tmp = rsound_host_state(rsound, i) == RSOUND_HOST_UP ?
+         rsd_pointer(rsound->rd[i]) : rsound_backlog(rsound, i);
+      if ( tmp > ptr )
+         ptr = tmp;
+   }
+   return ptr;
+}
+
+static int rsound_get_delay(snd_pcm_rsound_t *rsound)
+{
+   unsigned int i;
+   int delay = 0;
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      int tmp = rsound_host_state(rsound, i) == RSOUND_HOST_UP ?
+         (int)rsd_delay(rsound->rd[i]) : (int)rsound_backlog(rsound, i);
+      if ( tmp > delay )
+         delay = tmp;
+   }
+   return delay;
+}
+
+static int rsound_is_ready(snd_pcm_rsound_t *rsound)
+{
+   unsigned int i;
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      if ( rsound_host_state(rsound, i) == RSOUND_HOST_UP &&
+            !rsound->rd[i]->ready_for_data )
+         return 0;
+   }
+   return 1;
+}
+
+static void rsound_reconnect_stop(snd_pcm_rsound_t *rsound)
+{
+   pthread_mutex_lock(&rsound->reconnect_lock);
+   rsound->reconnect_quit = 1;
+   pthread_cond_signal(&rsound->reconnect_cond);
+   pthread_mutex_unlock(&rsound->reconnect_lock);
+
+   if ( rsound->reconnect_joinable )
+      pthread_join(rsound->reconnect_thread, NULL);
+   rsound->reconnect_joinable = 0;
+   rsound->reconnect_running = 0;
+   rsound->reconnect_quit = 0;
+}
+
+/* Restarts the stream position, e.g. for prepare. Hosts that are down will
+ * pick up from the new start. */
+static void rsound_reset_position(snd_pcm_rsound_t *rsound)
+{
+   unsigned int i;
+   uint64_t now = rsound_now();
+
+   rsound->written = 0;
+   rsound->drift_start = now;
+   rsound->drift_last = now;
+   rsound->drift_ref_time = 0;
+   rsound->drift_valid = 0;
+   rsound->correct_ppm = 0.0;
+   rsound->correct_integral = 0.0;
+   rsound->frame_offset = 0;
+   rsound->marks_head = rsound->marks_tail = 0;
+   rsound->played_offset = 0;
+   rsound->last_pos = 0;
+   rsound_resampler_reset(&rsound->resampler, rsound->channels);
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      if ( rsound_host_state(rsound, i) != RSOUND_HOST_UP )
+      {
+         rsound->resume[i] = 0;
+         rsound->down_since[i] = now;
+      }
+   }
+}
+
+static void rsound_disconnect(snd_pcm_rsound_t *rsound)
+{
+   unsigned int i;
+
+   /* The reconnect thread has to let go of its hosts first. */
+   rsound_reconnect_stop(rsound);
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      if ( (rsound->connected && rsound_host_state(rsound, i) == RSOUND_HOST_UP) ||
+            rsound_host_state(rsound, i) == RSOUND_HOST_BACK )
+         rsd_stop(rsound->rd[i]);
+      rsound_set_host_state(rsound, i, RSOUND_HOST_UP);
+   }
+   rsound->connected = 0;
+   rsound->written = 0;
+}
+
+/* Applies the socket and thread tuning to a freshly started handle.
+ * Failures are reported, but aren't fatal. */
+static void rsound_tune(snd_pcm_rsound_t *rsound, rsound_t *rd)
+{
+   if ( rsound->sndbuf > 0 &&
+         setsockopt(rd->conn.socket, SOL_SOCKET, SO_SNDBUF,
+            &rsound->sndbuf, sizeof(rsound->sndbuf)) < 0 )
+      SNDERR("Cannot set SO_SNDBUF to %d", rsound->sndbuf);
+
+   if ( rsound->nodelay >= 0 &&
+         setsockopt(rd->conn.socket, IPPROTO_TCP, TCP_NODELAY,
+            &rsound->nodelay, sizeof(rsound->nodelay)) < 0 )
+      SNDERR("Cannot set TCP_NODELAY");
+
+   if ( rsound->priority > 0 )
+   {
+      struct sched_param param = { .sched_priority = rsound->priority };
+      int err = pthread_setschedparam(rd->thread.threadId, SCHED_FIFO, &param);
+      if ( err )
+         SNDERR("Cannot set SCHED_FIFO priority %d: %s", rsound->priority, strerror(err));
+   }
+}
+
+static int rsound_connect(snd_pcm_ioplug_t *io)
+{
+   snd_pcm_rsound_t *rsound = io->private_data;
+   unsigned int i;
+
+   if ( rsound->connected )
+      return 0;
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      if ( rsd_start(rsound->rd[i]) < 0 )
+      {
+         while ( i-- > 0 )
+            rsd_stop(rsound->rd[i]);
+         return -EIO;
+      }
+   }
+
+   rsound->chunk_bytes = 0;
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      rsound_tune(rsound, rsound->rd[i]);
+      if ( rsound->rd[i]->backend_info.chunk_size > rsound->chunk_bytes )
+         rsound->chunk_bytes = rsound->rd[i]->backend_info.chunk_size;
+   }
+
+   /* written is left alone, a resume from pause goes on from there */
+   rsound->connected = 1;
+   return 0;
+}
+
+static void *rsound_reconnect_thread(void *data)
+{
+   snd_pcm_rsound_t *rsound = data;
+   int backoff = RSOUND_BACKOFF_MIN;
+   unsigned int i;
+
+   pthread_mutex_lock(&rsound->reconnect_lock);
+   while ( !rsound->reconnect_quit )
+   {
+      int pending = 0;
+
+      for ( i = 0; i < rsound->num_hosts && !rsound->reconnect_quit; i++ )
+      {
+         int rc;
+
+         if ( rsound_host_state(rsound, i) != RSOUND_HOST_DOWN )
+            continue;
+
+         /* The stream doesn't touch a host while it is down, so the
+          * connect can run without the lock. */
+         pthread_mutex_unlock(&rsound->reconnect_lock);
+         rc = rsd_start(rsound->rd[i]);
+         if ( rc >= 0 )
+            rsound_tune(rsound, rsound->rd[i]);
+         pthread_mutex_lock(&rsound->reconnect_lock);
+
+         if ( rc >= 0 )
+            rsound_set_host_state(rsound, i, RSOUND_HOST_BACK);
+         else
+            pending = 1;
+      }
+
+      if ( !pending )
+         break;
+
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += backoff / 1000;
+      ts.tv_nsec += (backoff % 1000) * 1000000L;
+      if ( ts.tv_nsec >= 1000000000L )
+      {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000L;
+      }
+      if ( !rsound->reconnect_quit )
+         pthread_cond_timedwait(&rsound->reconnect_cond, &rsound->reconnect_lock, &ts);
+
+      backoff *= 2;
+      if ( backoff > RSOUND_BACKOFF_MAX )
+         backoff = RSOUND_BACKOFF_MAX;
+   }
+   rsound->reconnect_running = 0;
+   pthread_mutex_unlock(&rsound->reconnect_lock);
+
+   return NULL;
+}
+
+/* Takes host i out of the stream after a write error and hands it to the
+ * reconnect thread. resume is the stream position it has to continue from. */
+static void rsound_host_failed(snd_pcm_rsound_t *rsound, unsigned int i, uint64_t resume)
+{
+   rsd_stop(rsound->rd[i]);
+
+   pthread_mutex_lock(&rsound->reconnect_lock);
+   rsound_set_host_state(rsound, i, RSOUND_HOST_DOWN);
+   rsound->resume[i] = resume;
+   rsound->down_since[i] = rsound_now();
+
+   if ( !rsound->reconnect_running )
+   {
+      if ( rsound->reconnect_joinable )
+         pthread_join(rsound->reconnect_thread, NULL);
+      rsound->reconnect_joinable = 0;
+      if ( pthread_create(&rsound->reconnect_thread, NULL, rsound_reconnect_thread, rsound) == 0 )
+      {
+         rsound->reconnect_running = 1;
+         rsound->reconnect_joinable = 1;
+      }
+      else
+         SNDERR("Cannot start reconnect thread");
+   }
+   pthread_mutex_unlock(&rsound->reconnect_lock);
+}
+
+/* rsd_write with the statistics kept */
+static ssize_t rsound_rsd_write(snd_pcm_rsound_t *rsound, rsound_t *rd,
+      const char *buf, size_t size)
+{
+   uint64_t start = rsound_now();
+   ssize_t result = rsd_write(rd, buf, size);
+   uint64_t us = (rsound_now() - start) / 1000;
+   int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+   if ( bucket >= RSOUND_STATS_BUCKETS )
+      bucket = RSOUND_STATS_BUCKETS - 1;
+   RSOUND_STATS_ADD(rsound->stats, write_latency[bucket], 1);
+
+   if ( result <= 0 )
+      RSOUND_STATS_ADD(rsound->stats, write_failures, 1);
+   else if ( (size_t)result < size )
+      RSOUND_STATS_ADD(rsound->stats, short_writes, 1);
+
+   return result;
+}
+
+static int rsound_write_all(snd_pcm_rsound_t *rsound, rsound_t *rd, const char *buf, size_t size)
+{
+   size_t done = 0;
+
+   while ( done < size )
+   {
+      ssize_t result = rsound_rsd_write(rsound, rd, buf + done, size - done);
+      if ( result <= 0 )
+         return -EIO;
+      done += result;
+   }
+   return 0;
+}
+
+/* Sends history[resume, written) to a host that just came back. */
+static int rsound_flush_backlog(snd_pcm_rsound_t *rsound, unsigned int i)
+{
+   uint64_t backlog = rsound_backlog(rsound, i);
+   size_t start, first;
+
+   if ( backlog == 0 )
+      return 0;
+
+   /* Fell out of the history, so the gap can't be filled anymore. */
+   if ( backlog > rsound->history_size )
+   {
+      rsound->resume[i] = RSOUND_RESUME_LIVE;
+      return 0;
+   }
+
+   start = rsound->resume[i] % rsound->history_size;
+   first = rsound->history_size - start;
+   if ( first > backlog )
+      first = backlog;
+
+   if ( rsound_write_all(rsound, rsound->rd[i], rsound->history + start, first) < 0 ||
+         rsound_write_all(rsound, rsound->rd[i], rsound->history, backlog - first) < 0 )
+      return -EIO;
+   return 0;
+}
+
+/* Puts hosts the reconnect thread brought back into the stream again. */
+static void rsound_recover(snd_pcm_rsound_t *rsound)
+{
+   int back[RSOUND_MAX_HOSTS];
+   unsigned int i;
+
+   if ( !rsound->reconnect || !rsound->reconnect_joinable )
+      return;
+
+   pthread_mutex_lock(&rsound->reconnect_lock);
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      back[i] = rsound_host_state(rsound, i) == RSOUND_HOST_BACK;
+      if ( back[i] )
+         rsound_set_host_state(rsound, i, RSOUND_HOST_UP);
+   }
+   pthread_mutex_unlock(&rsound->reconnect_lock);
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      if ( !back[i] )
+         continue;
+      RSOUND_STATS_ADD(rsound->stats, restarts, 1);
+      if ( rsound_flush_backlog(rsound, i) < 0 )
+         rsound_host_failed(rsound, i, rsound->resume[i]);
+   }
+}
+
+/* An outage longer than the buffer is an xrun. With other hosts still
+ * playing, the late host just drops its backlog and rejoins live. */
+static int rsound_check_outage(snd_pcm_rsound_t *rsound)
+{
+   uint64_t now = rsound_now();
+   uint64_t limit = (uint64_t)rsound->io.buffer_size * 1000000000ULL / rsound->rate;
+   int any_up = 0, overrun = 0;
+   unsigned int i;
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      if ( rsound_host_state(rsound, i) == RSOUND_HOST_UP )
+         any_up = 1;
+   }
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      if ( rsound_host_state(rsound, i) == RSOUND_HOST_UP ||
+            rsound->resume[i] == RSOUND_RESUME_LIVE )
+         continue;
+      if ( now - rsound->down_since[i] > limit ||
+            rsound_backlog(rsound, i) > rsound->history_size )
+      {
+         if ( any_up )
+            rsound->resume[i] = RSOUND_RESUME_LIVE;
+         else
+            overrun = 1;
+      }
+   }
+
+   return overrun ? -EPIPE : 0;
+}
+
+/* io->poll_fd is a timerfd rather than the socket. It is armed to expire
+ * when the librsound buffer is expected to have room for avail_min frames,
+ * so a poller wakes up once per period. timerfd_settime() also clears any
+ * pending expiration, so no read() is needed to rearm it. */
+static void rsound_arm_timer(snd_pcm_rsound_t *rsound, size_t avail)
+{
+   size_t need = rsound_avail_wanted(rsound);
+   uint64_t nsecs = 1;
+   struct itimerspec its = { .it_interval = { 0, 0 } };
+
+   if ( avail < need && rsound->rate > 0 )
+   {
+      nsecs = (uint64_t)(need - avail) * 1000000000ULL /
+         ((uint64_t)rsound->rate * rsound->frame_bytes);
+      if ( nsecs == 0 )
+         nsecs = 1;
+   }
+
+   /* Also wake up in time to flush coalesced data. */
+   if ( rsound->pending_bytes > 0 )
+   {
+      uint64_t deadline = rsound->pending_since + rsound->coalesce_time * 1000000ULL;
+      uint64_t now = rsound_now();
+      uint64_t left = deadline > now ? deadline - now : 1;
+      if ( left < nsecs )
+         nsecs = left;
+   }
+
+   its.it_value.tv_sec = nsecs / 1000000000ULL;
+   its.it_value.tv_nsec = nsecs % 1000000000ULL;
+   timerfd_settime(rsound->io.poll_fd, 0, &its, NULL);
+}
+
+/* An idle connection is left open for the next start. It has to be
+ * dropped when any audio hasn't played out yet, whether still in librsound
+ * or already with the server, or it would go on playing ahead of the next
+ * stream. */
 int rsound_stop(snd_pcm_ioplug_t *io)
 {
    snd_pcm_rsound_t *rsound = io->private_data;
-   rsd_stop(rsound->rd);
-   rsound->last_ptr = 0;
+   rsound->pending_bytes = 0;
+   if ( rsound->connected && rsound_get_delay(rsound) > 0 )
+      rsound_disconnect(rsound);
+   rsound_reset_position(rsound);
+   return 0;
+}
+
+static void rsound_history_append(snd_pcm_rsound_t *rsound, const char *buf, size_t size)
+{
+   size_t pos, first;
+
+   if ( size > rsound->history_size )
+   {
+      buf += size - rsound->history_size;
+      size = rsound->history_size;
+   }
+
+   pos = rsound->written % rsound->history_size;
+   first = rsound->history_size - pos;
+   if ( first > size )
+      first = size;
+   memcpy(rsound->history + pos, buf, first);
+   memcpy(rsound->history, buf + first, size - first);
+}
+
+/* Hands the same data to every host, so they all stay at the same position.
+ * In reconnect mode, a failing host is left behind to catch up later. */
+static int rsound_send(snd_pcm_rsound_t *rsound, const char *buf, size_t size)
+{
+   unsigned int i;
+
+   if ( rsound->history )
+      rsound_history_append(rsound, buf, size);
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      size_t done = 0;
+
+      if ( rsound_host_state(rsound, i) != RSOUND_HOST_UP )
+         continue;
+
+      while ( done < size )
+      {
+         ssize_t result = rsound_rsd_write(rsound, rsound->rd[i], buf + done, size - done);
+         if ( result <= 0 )
+         {
+            if ( !rsound->reconnect )
+            {
+               rsound_disconnect(rsound);
+               return -EIO;
+            }
+
+            /* Whatever was still queued in librsound is lost with the
+             * connection, so resume from before it. */
+            uint64_t pos = rsound->written + done;
+            uint64_t queued = rsd_pointer(rsound->rd[i]);
+            rsound_host_failed(rsound, i, queued < pos ? pos - queued : 0);
+            break;
+         }
+         done += result;
+      }
+   }
+
+   rsound->written += size;
+   RSOUND_STATS_ADD(rsound->stats, bytes_sent, size);
+   return 0;
+}
+
+static int rsound_flush_pending(snd_pcm_rsound_t *rsound)
+{
+   size_t bytes = rsound->pending_bytes;
+
+   if ( bytes == 0 )
+      return 0;
+
+   rsound->pending_bytes = 0;
+   return rsound_send(rsound, rsound->pending, bytes);
+}
+
+/* Flushes coalesced data that has waited long enough. */
+static int rsound_flush_expired(snd_pcm_rsound_t *rsound)
+{
+   if ( rsound->pending_bytes > 0 &&
+         rsound_now() - rsound->pending_since >= rsound->coalesce_time * 1000000ULL )
+      return rsound_flush_pending(rsound);
+   return 0;
+}
+
+/* Entry point for wire data, which goes through the coalescing stage when
+ * it is enabled. Writes at least as large as the threshold skip the copy. */
+static int rsound_queue(snd_pcm_rsound_t *rsound, const char *buf, size_t size)
+{
+   if ( !rsound->pending )
+      return rsound_send(rsound, buf, size);
+
+   if ( rsound->pending_bytes == 0 && size >= rsound->coalesce )
+      return rsound_send(rsound, buf, size);
+
+   while ( size > 0 )
+   {
+      size_t n = rsound->coalesce - rsound->pending_bytes;
+      if ( n > size )
+         n = size;
+
+      memcpy(rsound->pending + rsound->pending_bytes, buf, n);
+      if ( rsound->pending_bytes == 0 )
+      {
+         /* Have the timer wake a poller in time for the deadline, it may
+          * not call back into the plugin before then otherwise. */
+         rsound->pending_since = rsound_now();
+         rsound->pending_bytes = n;
+         rsound_arm_timer(rsound, rsound_get_avail(rsound));
+      }
+      else
+         rsound->pending_bytes += n;
+      buf += n;
+      size -= n;
+
+      if ( rsound->pending_bytes == rsound->coalesce &&
+            rsound_flush_pending(rsound) < 0 )
+         return -EIO;
+   }
+
+   return rsound_flush_expired(rsound);
+}
+
+/* Step of the resampler for the current correction, in 32.32 input frames
+ * per output frame. */
+static uint64_t rsound_correct_step(snd_pcm_rsound_t *rsound)
+{
+   return (uint64_t)((1.0 + rsound->correct_ppm * 1e-6) * 4294967296.0);
+}
+
+/* Records the offset as of the end of the data sent so far. With all marks
+ * in use, the newest one is moved up instead, which only holds its offset
+ * back a little longer. */
+static void rsound_mark_offset(snd_pcm_rsound_t *rsound)
+{
+   uint64_t sent = (rsound->written + rsound->pending_bytes) / rsound->frame_bytes;
+   unsigned int i = rsound->marks_head;
+
+   if ( i - rsound->marks_tail == RSOUND_OFFSET_MARKS )
+      i--;
+   else
+      rsound->marks_head++;
+   rsound->marks[i % RSOUND_OFFSET_MARKS].sent = sent;
+   rsound->marks[i % RSOUND_OFFSET_MARKS].offset = rsound->frame_offset;
+}
+
+/* Write path with drift correction. The wire format is native S16 here,
+ * converted first if the input isn't. */
+static int rsound_write_corrected(snd_pcm_rsound_t *rsound, const char *buf, size_t frames)
+{
+   size_t chunk = RSOUND_CONVERT_SAMPLES / rsound->channels;
+   uint64_t step = rsound_correct_step(rsound);
+
+   while ( frames > 0 )
+   {
+      size_t n = frames < chunk ? frames : chunk;
+      const int16_t *in = (const int16_t*)buf;
+      size_t out;
+
+      if ( rsound->convert )
+      {
+         rsound->convert(rsound->convbuf, buf, n * rsound->channels);
+         in = rsound->convbuf;
+         buf += n * rsound->in_frame_bytes;
+      }
+      else
+         buf += n * rsound->frame_bytes;
+
+      out = rsound_resample(&rsound->resampler, rsound->resbuf, in, n, step);
+      rsound->frame_offset += (int64_t)n - (int64_t)out;
+      if ( rsound_queue(rsound, (const char*)rsound->resbuf, out * rsound->frame_bytes) < 0 )
+         return -EIO;
+      frames -= n;
+   }
+
+   rsound_mark_offset(rsound);
    return 0;
 }
 
+/* Takes a drift sample once per RSOUND_DRIFT_INTERVAL and, with correction
+ * on, steers the resampler towards the target delay. The controller is a
+ * slow PI loop, 10 ms of error moves the ratio by 100 ppm. */
+static void rsound_drift_update(snd_pcm_rsound_t *rsound)
+{
+   uint64_t now = rsound_now();
+   int64_t byte_rate = (int64_t)rsound->rate * rsound->frame_bytes;
+   int64_t delay;
+   uint64_t played;
+   double dt;
+
+   if ( !rsound->connected || byte_rate <= 0 ||
+         now - rsound->drift_last < RSOUND_DRIFT_INTERVAL )
+      return;
+   dt = (now - rsound->drift_last) * 1e-9;
+   rsound->drift_last = now;
+
+   delay = rsound_get_delay(rsound);
+   if ( delay < 0 )
+      delay = 0;
+   if ( (uint64_t)delay > rsound->written )
+      delay = rsound->written;
+   played = rsound->written - delay;
+
+   if ( rsound->drift_ref_time == 0 )
+   {
+      if ( played == 0 || now - rsound->drift_start < RSOUND_DRIFT_SETTLE )
+         return;
+      rsound->drift_ref_time = now;
+      rsound->drift_ref_pos = played;
+      rsound->correct_target = delay + rsound->pending_bytes;
+      return;
+   }
+
+   if ( now - rsound->drift_ref_time >= RSOUND_DRIFT_SPAN )
+   {
+      double secs = (now - rsound->drift_ref_time) * 1e-9;
+      double played_secs = (double)(played - rsound->drift_ref_pos) / byte_rate;
+      rsound->drift_ppm = (played_secs / secs - 1.0) * 1e6;
+      rsound->drift_valid = 1;
+   }
+
+   if ( rsound->correct_active )
+   {
+      double err_ms = (double)(delay + (int64_t)rsound->pending_bytes -
+            rsound->correct_target) * 1000.0 / byte_rate;
+      double ppm;
+
+      rsound->correct_integral += err_ms * dt;
+      /* anti-windup, the integral alone may not exceed the limit */
+      if ( rsound->correct_integral > RSOUND_RESAMPLE_MAX_PPM * 10.0 )
+         rsound->correct_integral = RSOUND_RESAMPLE_MAX_PPM * 10.0;
+      else if ( rsound->correct_integral < -RSOUND_RESAMPLE_MAX_PPM * 10.0 )
+         rsound->correct_integral = -RSOUND_RESAMPLE_MAX_PPM * 10.0;
+
+      ppm = 10.0 * err_ms + 0.1 * rsound->correct_integral;
+      if ( ppm > RSOUND_RESAMPLE_MAX_PPM )
+         ppm = RSOUND_RESAMPLE_MAX_PPM;
+      else if ( ppm < -RSOUND_RESAMPLE_MAX_PPM )
+         ppm = -RSOUND_RESAMPLE_MAX_PPM;
+      rsound->correct_ppm = ppm;
+   }
+}
+
+/* Transfer callback. For MMAP_INTERLEAVED access, the areas point straight
+ * into the mmap ring buffer owned by the ioplug layer, and this is called on
+ * mmap_commit, so the data goes from there to librsound without an extra copy. */
 static snd_pcm_sframes_t rsound_write( snd_pcm_ioplug_t *io,
                   const snd_pcm_channel_area_t *areas,
                   snd_pcm_uframes_t offset,
@@ -50,90 +1250,225 @@ static snd_pcm_sframes_t rsound_write( snd_pcm_ioplug_t *io,
    const char *buf = (char*)areas->addr + (areas->first + areas->step * offset) / 8;
    size *= rsound->frame_bytes;
 
-   ssize_t result = rsd_write(rsound->rd, buf, size);
-   if ( result <= 0 )
+   rsound_recover(rsound);
+
+   /* Only hand librsound what fits without blocking. */
+   if ( io->nonblock )
    {
-      rsound_stop(io);
-      return -EIO;
+      size_t avail = rsound_get_avail(rsound);
+      avail -= avail % rsound->frame_bytes;
+      if ( avail == 0 )
+         return -EAGAIN;
+      if ( size > avail )
+         size = avail;
+   }
+   else if ( rsound->latency_bytes > 0 )
+   {
+      /* A blocking write waits for room under the latency target, like
+       * rsd_write() does for room in the librsound buffer. */
+      size_t want = rsound_avail_wanted(rsound), room;
+      int64_t byte_rate = (int64_t)rsound->rate * rsound->frame_bytes;
+
+      if ( want > size )
+         want = size;
+      while ( (room = rsound_latency_room(rsound)) < want )
+      {
+         int64_t nsecs = (int64_t)(want - room) * 1000000000LL / byte_rate + 1;
+         struct timespec ts = { nsecs / 1000000000LL, nsecs % 1000000000LL };
+         int err;
+
+         nanosleep(&ts, NULL);
+         rsound_recover(rsound);
+         if ( rsound->reconnect && (err = rsound_check_outage(rsound)) < 0 )
+            return err;
+      }
+      room -= room % rsound->frame_bytes;
+      if ( size > room )
+         size = room;
    }
-   return result/rsound->frame_bytes;
+
+   if ( rsound->correct_active )
+   {
+      if ( rsound_write_corrected(rsound, buf, size / rsound->frame_bytes) < 0 )
+         return -EIO;
+   }
+   else if ( rsound->convert )
+   {
+      size_t frames = size / rsound->frame_bytes;
+      size_t chunk = RSOUND_CONVERT_SAMPLES / io->channels;
+
+      while ( frames > 0 )
+      {
+         size_t n = frames < chunk ? frames : chunk;
+         rsound->convert(rsound->convbuf, buf, n * io->channels);
+         if ( rsound_queue(rsound, (const char*)rsound->convbuf, n * rsound->frame_bytes) < 0 )
+            return -EIO;
+         buf += n * rsound->in_frame_bytes;
+         frames -= n;
+      }
+   }
+   else if ( rsound_queue(rsound, buf, size) < 0 )
+      return -EIO;
+
+   size_t avail = rsound_get_avail(rsound);
+   if ( avail < rsound_avail_wanted(rsound) )
+      rsound_arm_timer(rsound, avail);
+
+   return size/rsound->frame_bytes;
 }
 
 static int rsound_start(snd_pcm_ioplug_t *io)
 {
-   int rc;
-   snd_pcm_rsound_t *rsound = io->private_data;
-   rc = rsd_start(rsound->rd);
-   rsound->last_ptr = 0;
-   if ( rc < 0 )
-   {
-      return -EIO;
-   }
-   
-   io->poll_fd = rsound->rd->conn.socket;
-   io->poll_events = POLLOUT;
-   snd_pcm_ioplug_reinit_status(io);
-   return 0;
+   return rsound_connect(io);
 }
 
+/* The hardware position is everything librsound has accepted minus what is
+ * still queued in its buffer. This is kept as a monotonic 64-bit byte count,
+ * so appl_ptr wrapping at the boundary or snd_pcm_reset() doesn't need the
+ * connection to be torn down. The ioplug layer works out the delta from the
+ * position modulo the buffer size. */
 static snd_pcm_sframes_t rsound_pointer(snd_pcm_ioplug_t *io)
 {
    snd_pcm_rsound_t *rsound = io->private_data;
-   int ptr;
-   
-   if ( io->appl_ptr < rsound->last_ptr )
+   uint64_t queued, played;
+
+   if ( rsound_flush_expired(rsound) < 0 )
+      return -EIO;
+
+   if ( rsound->reconnect )
    {
-      rsound_stop(io);
-      rsound_start(io);
+      int err;
+      rsound_recover(rsound);
+      if ( (err = rsound_check_outage(rsound)) < 0 )
+         return err;
    }
 
-   ptr = rsd_pointer(rsound->rd);	
-   ptr /= rsound->frame_bytes;
+   queued = rsound_get_pointer(rsound);
+   if ( queued > rsound->written )
+      queued = rsound->written;
 
-   ptr = io->appl_ptr - ptr;
-   rsound->last_ptr = io->appl_ptr;
+   played = (rsound->written - queued) / rsound->frame_bytes;
 
-   return ptr;
+   /* In application frames, which differ from sent ones by what the drift
+    * correction added or dropped up to the frames played. */
+   while ( rsound->marks_tail != rsound->marks_head &&
+         rsound->marks[rsound->marks_tail % RSOUND_OFFSET_MARKS].sent <= played )
+   {
+      rsound->played_offset = rsound->marks[rsound->marks_tail % RSOUND_OFFSET_MARKS].offset;
+      rsound->marks_tail++;
+   }
+   if ( rsound->played_offset < 0 && played < (uint64_t)-rsound->played_offset )
+      played = 0;
+   else
+      played += rsound->played_offset;
+
+   /* The ioplug layer takes a pointer going back for a wrap of the whole
+    * buffer, and a mark can still lower the offset a little. */
+   if ( played < rsound->last_pos )
+      played = rsound->last_pos;
+   rsound->last_pos = played;
+
+   rsound_drift_update(rsound);
+
+   return played % io->buffer_size;
 }
 
 static int rsound_close(snd_pcm_ioplug_t *io)
 {
    snd_pcm_rsound_t *rsound = io->private_data;
-   rsd_free(rsound->rd);
+   unsigned int i;
+   rsound_disconnect(rsound);
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      rsd_free(rsound->rd[i]);
+      free(rsound->host_name[i]);
+   }
+   close(io->poll_fd);
+   free(rsound->history);
+   free(rsound->pending);
+   if ( rsound->open_job )
+      rsound_open_job_release(rsound->open_job);
+   rsound_stats_close(rsound);
+   pthread_mutex_destroy(&rsound->reconnect_lock);
+   pthread_cond_destroy(&rsound->reconnect_cond);
    free(rsound);
    return 0;
 }
 
-static int rsound_prepare(snd_pcm_ioplug_t *io)
-{
-   return rsound_start(io);
+static int rsound_prepare(snd_pcm_ioplug_t *io)
+{
+   snd_pcm_rsound_t *rsound = io->private_data;
+   int err;
+
+   if ( (err = rsound_open_wait(rsound)) < 0 )
+      return err;
+
+   rsound->pending_bytes = 0;
+   rsound_reset_position(rsound);
+   if ( (err = rsound_connect(io)) < 0 )
+      return err;
+
+   rsound_arm_timer(rsound, rsound_get_avail(rsound));
+   return 0;
 }
 
 static int rsound_hw_constraint(snd_pcm_rsound_t *rsound)
 {
 	snd_pcm_ioplug_t *io = &rsound->io;
-	static const snd_pcm_access_t access_list[] = { SND_PCM_ACCESS_RW_INTERLEAVED };
+	static const snd_pcm_access_t access_list[] = { SND_PCM_ACCESS_RW_INTERLEAVED,
+                                                   SND_PCM_ACCESS_MMAP_INTERLEAVED };
 
 	static const unsigned int formats[] = {   SND_PCM_FORMAT_S16_LE,
                                              SND_PCM_FORMAT_S16_BE, 
                                              SND_PCM_FORMAT_U16_LE,
                                              SND_PCM_FORMAT_U16_BE,
                                              SND_PCM_FORMAT_U8,
-                                             SND_PCM_FORMAT_S8 };
+                                             SND_PCM_FORMAT_S8,
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+                                             /* converted to S16_LE in the plugin */
+                                             SND_PCM_FORMAT_FLOAT_LE,
+                                             SND_PCM_FORMAT_S32_LE,
+                                             SND_PCM_FORMAT_S24_3LE
+#endif
+                                          };
 
+	unsigned int period_min = 1 << 6, buffer_min = 1 << 13;
+	unsigned int i;
 	int err;
-	
-   if ((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_FORMAT, 6, formats)) < 0 )
+
+   /* A period shorter than the server's chunk doesn't reach its output any
+    * sooner, so don't offer one. The chunk is known as time and the floor is
+    * in bytes before the format and rate are, so it is taken at the slowest
+    * stream, which holds for every other one. With several hosts the largest
+    * chunk counts. While connecting in the background, only cached results
+    * are used; the stream's own chunk is applied to poll once connected. */
+   if ( rsound->probe )
+   {
+      for ( i = 0; i < rsound->num_hosts; i++ )
+      {
+         uint64_t chunk = rsound_probe(rsound->host_name[i], rsound->rd[i]->port,
+               rsound->open_job != NULL) * RSOUND_MIN_BYTE_RATE / 1000000000ULL;
+         if ( chunk > period_min )
+            period_min = chunk > 1 << 18 ? 1 << 18 : chunk;
+      }
+      if ( period_min > 1 << 18 )
+         period_min = 1 << 18;
+      if ( buffer_min < 2 * period_min )
+         buffer_min = 2 * period_min;
+   }
+
+   if ((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_FORMAT,
+               sizeof(formats) / sizeof(formats[0]), formats)) < 0 )
 		goto const_err;
-	if ((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS, 1, access_list)) < 0)
+	if ((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS, 2, access_list)) < 0)
 		goto const_err;
    if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_CHANNELS, 1, 8)) < 0)
       goto const_err;
 	if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_RATE, 8000, 96000)) < 0 )
 		goto const_err;
-	if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_BUFFER_BYTES, 1 << 13, 1 << 24)) < 0)
+	if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_BUFFER_BYTES, buffer_min, 1 << 24)) < 0)
 		goto const_err;
-   if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES, 1 << 6, 1 << 18)) < 0 )
+   if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES, period_min, 1 << 18)) < 0 )
 		goto const_err;
 	if ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIODS, 1, 1024)) < 0)
 		goto const_err;
@@ -143,12 +1478,20 @@ const_err:
    return err;
 }
 
+/* Size of the librsound buffer for an ALSA buffer of the given size. The
+ * two have to match, avail and poll go by the librsound one. */
+static int rsound_buffer_bytes(snd_pcm_rsound_t *rsound, snd_pcm_uframes_t frames)
+{
+   return (int)(frames * rsound->frame_bytes);
+}
+
 static int rsound_hw_params(snd_pcm_ioplug_t *io,
                snd_pcm_hw_params_t *params)
 {
 	snd_pcm_rsound_t *rsound = io->private_data;
 
    int format;
+   int err;
 
    switch ( io->format )
    {
@@ -170,35 +1513,113 @@ static int rsound_hw_params(snd_pcm_ioplug_t *io,
       case SND_PCM_FORMAT_S8:
          format = RSD_S8;
          break;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+      case SND_PCM_FORMAT_FLOAT_LE:
+      case SND_PCM_FORMAT_S32_LE:
+      case SND_PCM_FORMAT_S24_3LE:
+         format = RSD_S16_LE;
+         break;
+#endif
       default:
          return -EINVAL;
    }
 
-   rsd_set_param(rsound->rd, RSD_FORMAT, &format);
+   /* The resampler only handles native S16 */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+   rsound->correct_active = rsound->drift_correct && format == RSD_S16_LE &&
+      io->channels <= RSOUND_RESAMPLE_MAX_CHANNELS;
+#else
+   rsound->correct_active = 0;
+#endif
+
+   rsound->convert = rsound_get_convert(io->format);
+   rsound->in_frame_bytes = io->channels * snd_pcm_format_physical_width(io->format) / 8;
 
 	if ( io->stream != SND_PCM_STREAM_PLAYBACK )
 	{
 		return -EINVAL;
 	}
 
+   if ( (err = rsound_open_wait(rsound)) < 0 )
+      return err;
+
 	int rate = io->rate;
 	int channels = io->channels;
    snd_pcm_uframes_t buffersize;
-   rsd_set_param(rsound->rd, RSD_SAMPLERATE, &rate);
-   rsd_set_param(rsound->rd, RSD_CHANNELS, &channels);
-	
-   int err;
    
    if ((err = snd_pcm_hw_params_get_buffer_size(params, &buffersize) < 0))
 	{
       return err;
 	}
 
-   rsound->frame_bytes = io->channels * rsd_samplesize(rsound->rd);
+   /* Gathering more than a period could hold data back for good, as the
+    * application waits for room before it writes again. */
+   if ( rsound->pending )
+   {
+      size_t period = io->period_size * io->channels *
+         (format == RSD_U8 || format == RSD_S8 ? 1 : 2);
+      rsound->coalesce = rsound->coalesce_conf < period ? rsound->coalesce_conf : period;
+   }
+
+   /* Only renegotiate with the server if something actually changed. */
+   if ( rsound->connected &&
+         format == rsound->format && rate == rsound->rate &&
+         channels == rsound->channels &&
+         rsound_buffer_bytes(rsound, buffersize) == rsound->bufsize )
+      return 0;
+
+   rsound_disconnect(rsound);
+
+   unsigned int i;
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      rsd_set_param(rsound->rd[i], RSD_FORMAT, &format);
+      rsd_set_param(rsound->rd[i], RSD_SAMPLERATE, &rate);
+      rsd_set_param(rsound->rd[i], RSD_CHANNELS, &channels);
+   }
+
+   rsound->frame_bytes = io->channels * rsd_samplesize(rsound->rd[0]);
+   rsound->latency_bytes = 0;
+   if ( rsound->latency > 0 )
+   {
+      rsound->latency_bytes = (size_t)((uint64_t)rate * rsound->latency / 1000) *
+         rsound->frame_bytes;
+      if ( rsound->latency_bytes < (size_t)rsound->frame_bytes )
+         rsound->latency_bytes = rsound->frame_bytes;
+   }
    
-   buffersize *= rsound->frame_bytes;
-   int bufsiz = (int)buffersize;
-   rsd_set_param(rsound->rd, RSD_BUFSIZE, &bufsiz);
+   int bufsiz = rsound_buffer_bytes(rsound, buffersize);
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      rsd_set_param(rsound->rd[i], RSD_BUFSIZE, &bufsiz);
+      if ( rsound->latency > 0 )
+         rsd_set_param(rsound->rd[i], RSD_LATENCY, &rsound->latency);
+   }
+
+   if ( rsound->reconnect )
+   {
+      free(rsound->history);
+      rsound->history = malloc(bufsiz);
+      rsound->history_size = rsound->history ? bufsiz : 0;
+      if ( !rsound->history )
+         return -ENOMEM;
+   }
+
+   rsound->format = format;
+   rsound->rate = rate;
+   rsound->channels = channels;
+   rsound->bufsize = bufsiz;
+
+   return 0;
+}
+
+static int rsound_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *params)
+{
+   snd_pcm_rsound_t *rsound = io->private_data;
+
+   snd_pcm_sw_params_get_avail_min(params, &rsound->avail_min);
+   if ( rsound->avail_min == 0 )
+      rsound->avail_min = 1;
 
    return 0;
 }
@@ -207,21 +1628,121 @@ static int rsound_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp)
 {
    snd_pcm_rsound_t *rsound = io->private_data;
 
-   int ptr = rsd_delay(rsound->rd);
+   int ptr = rsound_get_delay(rsound);
    if ( ptr < 0 )
       ptr = 0;
+   ptr += rsound->pending_bytes;
    
    *delayp = ptr / rsound->frame_bytes;
 
    return 0;
 }
 
-static int rsound_pause(snd_pcm_ioplug_t *io, int enable)
+static void rsound_dump(snd_pcm_ioplug_t *io, snd_output_t *out)
 {
-   if ( enable )
-      return rsound_stop(io);
+   snd_pcm_rsound_t *rsound = io->private_data;
+   unsigned int i;
+
+   snd_output_printf(out, "%s\n", io->name);
+   for ( i = 0; i < rsound->num_hosts; i++ )
+      snd_output_printf(out, "  host %s:%s\n",
+            rsound->host_name[i] ? rsound->host_name[i] : "(default)",
+            rsound->rd[i]->port ? rsound->rd[i]->port : "(default)");
+
+   if ( rsound->drift_valid )
+      snd_output_printf(out, "  drift: %+.1f ppm over %.0f s\n", rsound->drift_ppm,
+            (rsound->drift_last - rsound->drift_ref_time) * 1e-9);
    else
-      return rsound_start(io);
+      snd_output_printf(out, "  drift: not known yet\n");
+   if ( rsound->correct_active )
+      snd_output_printf(out, "  correction: %+.1f ppm\n", rsound->correct_ppm);
+
+   snd_output_printf(out, "  bytes sent: %llu\n",
+         (unsigned long long)RSOUND_STATS_GET(rsound->stats, bytes_sent));
+   snd_output_printf(out, "  short writes: %llu, failed writes: %llu, restarts: %llu\n",
+         (unsigned long long)RSOUND_STATS_GET(rsound->stats, short_writes),
+         (unsigned long long)RSOUND_STATS_GET(rsound->stats, write_failures),
+         (unsigned long long)RSOUND_STATS_GET(rsound->stats, restarts));
+   snd_output_printf(out, "  write latency (us, log2 buckets):");
+   for ( i = 0; i < RSOUND_STATS_BUCKETS; i++ )
+   {
+      uint64_t n = RSOUND_STATS_GET(rsound->stats, write_latency[i]);
+      if ( n )
+         snd_output_printf(out, " <%llu:%llu", 1ULL << i, (unsigned long long)n);
+   }
+   snd_output_printf(out, "\n");
+   if ( rsound->stats_name[0] )
+      snd_output_printf(out, "  shared as %s\n", rsound->stats_name);
+
+   snd_output_printf(out, "Its setup is:\n");
+   snd_pcm_dump_setup(io->pcm, out);
+}
+
+/* Everything has been handed to librsound by the time drain is called, so
+ * just sleep for the remaining delay of the slowest host. The sockets are
+ * polled meanwhile, so a host going away ends the wait early. */
+static int rsound_drain(snd_pcm_ioplug_t *io)
+{
+   snd_pcm_rsound_t *rsound = io->private_data;
+   struct pollfd fds[RSOUND_MAX_HOSTS];
+   int64_t byte_rate = (int64_t)rsound->rate * rsound->frame_bytes;
+   int delay, last = -1;
+   unsigned int i;
+
+   if ( !rsound->connected || byte_rate <= 0 )
+      return 0;
+
+   if ( rsound_flush_pending(rsound) < 0 )
+      return -EIO;
+
+   for ( i = 0; i < rsound->num_hosts; i++ )
+   {
+      fds[i].fd = rsound_host_state(rsound, i) == RSOUND_HOST_UP ?
+         rsound->rd[i]->conn.socket : -1;
+      fds[i].events = 0;
+   }
+
+   /* Stop once nothing is left, or if the delay doesn't go down anymore. */
+   while ( (delay = rsound_get_delay(rsound)) > 0 && (last < 0 || delay < last) )
+   {
+      int64_t nsecs = delay * 1000000000LL / byte_rate;
+      struct timespec ts = { nsecs / 1000000000LL, nsecs % 1000000000LL };
+      int rc = ppoll(fds, rsound->num_hosts, &ts, NULL);
+
+      if ( rc < 0 && errno != EINTR )
+         return -errno;
+      if ( rc > 0 )
+      {
+         rsound_disconnect(rsound);
+         return -EIO;
+      }
+      last = delay;
+   }
+
+   return 0;
+}
+
+/* Pausing drops the connection, and with it what librsound still had
+ * queued, but not the stream position. ioplug keeps its own across the
+ * pause and would take a pointer going back for a wrap, so the dropped
+ * audio counts as played. */
+static int rsound_pause(snd_pcm_ioplug_t *io, int enable)
+{
+   snd_pcm_rsound_t *rsound = io->private_data;
+   uint64_t written;
+
+   if ( !enable )
+      return rsound_connect(io);
+
+   rsound_flush_pending(rsound);
+   written = rsound->written;
+   rsound_disconnect(rsound);
+   rsound->written = written;
+
+   /* The server's clock can't be followed while nothing plays. */
+   rsound->drift_start = rsound->drift_last = rsound_now();
+   rsound->drift_ref_time = 0;
+   return 0;
 }
 
 static int rsound_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
@@ -232,24 +1753,23 @@ static int rsound_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
    (void)pfd;
    (void)nfds;
 
-   assert ( rsound->rd->conn.socket > 0 );
-
-   struct pollfd fd = {
-      .fd = rsound->rd->conn.socket,
-      .events = POLLOUT
-   };
-
-   if ( poll(&fd, 1, 0) < 0 )
+   if ( rsound_flush_expired(rsound) < 0 )
    {
-      perror("poll");
-      *revents = 0;
+      *revents = POLLERR;
       return -EIO;
    }
 
-   if ( rsound->rd->ready_for_data && (fd.revents & POLLOUT) )
+   size_t avail = rsound_get_avail(rsound);
+
+   /* Only report writable once avail_min frames fit in the librsound buffer,
+    * and under the latency target if there is one. Leave the timer expired
+    * while that holds, otherwise rearm it. */
+   if ( rsound_is_ready(rsound) &&
+         avail >= rsound_avail_wanted(rsound) )
       *revents = POLLOUT;
    else
    {
+      rsound_arm_timer(rsound, avail);
       *revents = 0;
    }
 
@@ -264,18 +1784,119 @@ static const snd_pcm_ioplug_callback_t rsound_playback_callback = {
 	.close = rsound_close,
    .delay = rsound_delay,
 	.hw_params = rsound_hw_params,
+   .sw_params = rsound_sw_params,
 	.prepare = rsound_prepare,
+   .drain = rsound_drain,
    .pause = rsound_pause,
-   .poll_revents = rsound_poll_revents
+   .poll_revents = rsound_poll_revents,
+   .dump = rsound_dump
 };
 
+/* Adds a librsound handle for host:port. Either may be NULL to use the
+ * librsound defaults. */
+static int rsound_add_host(snd_pcm_rsound_t *rsound, const char *host, const char *port)
+{
+   rsound_t *rd;
+
+   if ( rsound->num_hosts >= RSOUND_MAX_HOSTS )
+   {
+      SNDERR("Too many hosts, at most %d are supported", RSOUND_MAX_HOSTS);
+      return -EINVAL;
+   }
+
+   if ( rsd_init(&rd) < 0 )
+   {
+      SNDERR("Cannot allocate");
+      return -ENOMEM;
+   }
+   rsound->rd[rsound->num_hosts++] = rd;
+
+   if ( host && strlen(host) )
+   {
+      rsd_set_param(rd, RSD_HOST, (void*)host);
+      rsound->host_name[rsound->num_hosts - 1] = strdup(host);
+      if ( !rd->host || !rsound->host_name[rsound->num_hosts - 1] )
+      {
+         SNDERR("Cannot allocate");
+         return -ENOMEM;
+      }
+   }
+   
+   if ( port && strlen(port) )
+   {
+      rsd_set_param(rd, RSD_PORT, (void*)port);
+      if ( !rd->port )
+      {
+         SNDERR("Cannot allocate");
+         return -ENOMEM;
+      }
+   }
+
+   return 0;
+}
+
+/* Parses one entry of the hosts list, { host "name" port "12345" } */
+static int rsound_parse_host(snd_pcm_rsound_t *rsound, snd_config_t *conf)
+{
+	snd_config_iterator_t i, next;
+	const char *host = NULL;
+	const char *port = NULL;
+
+   if ( snd_config_get_type(conf) != SND_CONFIG_TYPE_COMPOUND )
+   {
+      SNDERR("Invalid type for hosts entry");
+      return -EINVAL;
+   }
+
+	snd_config_for_each(i, next, conf)
+	{
+		snd_config_t *n = snd_config_iterator_entry(i);
+		const char *id;
+		if ( snd_config_get_id(n, &id) < 0 )
+			continue;
+		if (strcmp(id, "host") == 0)
+		{
+			if ( snd_config_get_string(n, &host) < 0 )
+			{
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "port") == 0)
+		{
+			if ( snd_config_get_string(n, &port) < 0 )
+			{
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+      SNDERR("Unknown field %s in hosts entry", id);
+		return -EINVAL;
+	}
+
+   return rsound_add_host(rsound, host, port);
+}
+
 SND_PCM_PLUGIN_DEFINE_FUNC(rsound)
 {
    (void) root;
 	snd_config_iterator_t i, next;
 	const char *host = NULL;
 	const char *port = NULL;
+	snd_config_t *hosts = NULL;
+	long latency = 0, sndbuf = 0, priority = 0;
+	int nodelay = -1;
+	int reconnect = 0;
+	int probe = 1;
+	int drift_correct = 0;
+	int async_connect = 1;
+	int stats = 0;
+	long connect_timeout = 5000;
+	long coalesce = 0, coalesce_time = 5;
 	int err;
+	unsigned int j;
 	snd_pcm_rsound_t *rsound;
 
 	snd_config_for_each(i, next, conf)
@@ -304,6 +1925,128 @@ SND_PCM_PLUGIN_DEFINE_FUNC(rsound)
 			}
 			continue;
 		}
+		if (strcmp(id, "latency") == 0)
+		{
+			if ( snd_config_get_integer(n, &latency) < 0 || latency < 0 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "sndbuf") == 0)
+		{
+			if ( snd_config_get_integer(n, &sndbuf) < 0 || sndbuf < 0 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "nodelay") == 0)
+		{
+			if ( (nodelay = snd_config_get_bool(n)) < 0 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "coalesce") == 0)
+		{
+			if ( snd_config_get_integer(n, &coalesce) < 0 ||
+               coalesce < 0 || coalesce > (1 << 20) )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "coalesce_time") == 0)
+		{
+			if ( snd_config_get_integer(n, &coalesce_time) < 0 ||
+               coalesce_time <= 0 || coalesce_time > 1000 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "stats") == 0)
+		{
+			if ( (stats = snd_config_get_bool(n)) < 0 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "async_connect") == 0)
+		{
+			if ( (async_connect = snd_config_get_bool(n)) < 0 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "connect_timeout") == 0)
+		{
+			if ( snd_config_get_integer(n, &connect_timeout) < 0 ||
+               connect_timeout <= 0 || connect_timeout > 600000 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "drift_correct") == 0)
+		{
+			if ( (drift_correct = snd_config_get_bool(n)) < 0 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "probe") == 0)
+		{
+			if ( (probe = snd_config_get_bool(n)) < 0 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "reconnect") == 0)
+		{
+			if ( (reconnect = snd_config_get_bool(n)) < 0 )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "priority") == 0)
+		{
+			if ( snd_config_get_integer(n, &priority) < 0 ||
+               priority < 0 || priority > sched_get_priority_max(SCHED_FIFO) )
+			{
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "hosts") == 0)
+		{
+			if ( snd_config_get_type(n) != SND_CONFIG_TYPE_COMPOUND )
+			{
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			hosts = n;
+			continue;
+		}
       SNDERR("Unknown field %s", id);
 		return -EINVAL;
 	}
@@ -314,37 +2057,73 @@ SND_PCM_PLUGIN_DEFINE_FUNC(rsound)
 		SNDERR("Cannot allocate");
 		return -ENOMEM;
 	}
-   if ( rsd_init(&rsound->rd) < 0 )
+   rsound->io.poll_fd = -1;
+   rsound->latency = latency;
+   rsound->sndbuf = sndbuf;
+   rsound->nodelay = nodelay;
+   rsound->priority = priority;
+   rsound->reconnect = reconnect;
+   rsound->probe = probe;
+   rsound->drift_correct = drift_correct;
+   rsound->connect_timeout = connect_timeout;
+   rsound->stats = &rsound->local_stats;
+   rsound->stats->magic = RSOUND_STATS_MAGIC;
+   rsound->stats->version = RSOUND_STATS_VERSION;
+   rsound->stats->pid = getpid();
+   if ( stats )
+      rsound_stats_share(rsound);
+   rsound->coalesce = rsound->coalesce_conf = coalesce;
+   rsound->coalesce_time = coalesce_time;
+   if ( coalesce > 0 )
    {
-      SNDERR("Cannot allocate");
-      free(rsound);
-      return -ENOMEM;
+      rsound->pending = malloc(coalesce);
+      if ( !rsound->pending )
+      {
+         SNDERR("Cannot allocate");
+         err = -ENOMEM;
+         goto error;
+      }
    }
+   pthread_mutex_init(&rsound->reconnect_lock, NULL);
+   pthread_cond_init(&rsound->reconnect_cond, NULL);
 
+   /* host/port name the first host, the hosts list adds any further ones. */
+   if ( host || port || !hosts )
+   {
+      if ( (err = rsound_add_host(rsound, host, port)) < 0 )
+         goto error;
+   }
 
-   if ( host && strlen(host) )
+   if ( hosts )
    {
-      rsd_set_param(rsound->rd, RSD_HOST, (void*)host);
-      if ( !rsound->rd->host )
+      snd_config_for_each(i, next, hosts)
       {
-         SNDERR("Cannot allocate");
-         free(rsound);
-         return -ENOMEM;
+         if ( (err = rsound_parse_host(rsound, snd_config_iterator_entry(i))) < 0 )
+            goto error;
       }
    }
-   
-   if ( port && strlen(port) )
+
+   if ( rsound->num_hosts == 0 )
    {
-      rsd_set_param(rsound->rd, RSD_PORT, (void*)port);
-      if ( !rsound->rd->port )
-      {
-         SNDERR("Cannot allocate");
-         free(rsound);
-         return -ENOMEM;
-      }
+      SNDERR("No hosts defined");
+      err = -EINVAL;
+      goto error;
    }
 
-   rsound->last_ptr = 0;
+   if ( async_connect )
+      rsound_open_start(rsound);
+
+   rsound->written = 0;
+   rsound->avail_min = 1;
+
+   rsound->io.poll_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if ( rsound->io.poll_fd < 0 )
+   {
+      err = -errno;
+      SNDERR("Cannot create timerfd");
+      goto error;
+   }
+   rsound->io.poll_events = POLLIN;
 	
 	rsound->io.version = SND_PCM_IOPLUG_VERSION;
 	rsound->io.name = "ALSA <-> RSound output plugin";
@@ -359,15 +2138,26 @@ SND_PCM_PLUGIN_DEFINE_FUNC(rsound)
 	err = rsound_hw_constraint(rsound);
 	if ( err != 0 )
 	{
+		/* rsound_close() releases everything from here */
 		snd_pcm_ioplug_delete(&rsound->io);
-		goto error;
+		return err;
 	}
 
 	*pcmp = rsound->io.pcm;
    return 0;
 
 error:
-   rsd_free(rsound->rd);
+   rsound_stats_close(rsound);
+   if ( rsound->open_job )
+      rsound_open_job_release(rsound->open_job);
+   free(rsound->pending);
+   if ( rsound->io.poll_fd >= 0 )
+      close(rsound->io.poll_fd);
+   for ( j = 0; j < rsound->num_hosts; j++ )
+   {
+      rsd_free(rsound->rd[j]);
+      free(rsound->host_name[j]);
+   }
 	free(rsound);
 	return err;
 }
@@ -0,0 +1,294 @@
+/*
+ * ALSA <-> RSound PCM output plugin, sample format conversion
+ *
+ * Converts FLOAT_LE, S32_LE and S24_3LE input to the S16 wire format.
+ * Each format has a scalar version and SSE2/SSSE3/AVX2 or NEON kernels,
+ * picked at runtime where the CPU needs checking.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <string.h>
+#include <math.h>
+#include "rsound_convert.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * scalar versions, these also handle the tails of the SIMD kernels
+ */
+
+static void float_to_s16_c(int16_t *dst, const void *src, size_t samples)
+{
+   const float *in = src;
+   size_t i;
+
+   for ( i = 0; i < samples; i++ )
+   {
+      float s = in[i] * 32768.0f;
+      if ( s > 32767.0f )
+         s = 32767.0f;
+      else if ( s < -32768.0f )
+         s = -32768.0f;
+      dst[i] = (int16_t)lrintf(s);
+   }
+}
+
+static void s32_to_s16_c(int16_t *dst, const void *src, size_t samples)
+{
+   const int32_t *in = src;
+   size_t i;
+
+   for ( i = 0; i < samples; i++ )
+      dst[i] = (int16_t)(in[i] >> 16);
+}
+
+static void s24_3le_to_s16_c(int16_t *dst, const void *src, size_t samples)
+{
+   const uint8_t *in = src;
+   size_t i;
+
+   for ( i = 0; i < samples; i++, in += 3 )
+      dst[i] = (int16_t)(in[1] | (in[2] << 8));
+}
+
+/*
+ * SSE2, baseline on x86-64
+ */
+
+#if defined(__SSE2__)
+static void float_to_s16_sse2(int16_t *dst, const void *src, size_t samples)
+{
+   const float *in = src;
+   const __m128 scale = _mm_set1_ps(32768.0f);
+   const __m128 max = _mm_set1_ps(32767.0f);
+   const __m128 min = _mm_set1_ps(-32768.0f);
+   size_t i;
+
+   for ( i = 0; i + 8 <= samples; i += 8 )
+   {
+      __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+      __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+      a = _mm_max_ps(_mm_min_ps(a, max), min);
+      b = _mm_max_ps(_mm_min_ps(b, max), min);
+      _mm_storeu_si128((__m128i*)(dst + i),
+            _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+   }
+   float_to_s16_c(dst + i, in + i, samples - i);
+}
+
+static void s32_to_s16_sse2(int16_t *dst, const void *src, size_t samples)
+{
+   const int32_t *in = src;
+   size_t i;
+
+   for ( i = 0; i + 8 <= samples; i += 8 )
+   {
+      __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(in + i)), 16);
+      __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(in + i + 4)), 16);
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+   }
+   s32_to_s16_c(dst + i, in + i, samples - i);
+}
+#endif
+
+/*
+ * AVX2 and SSSE3, only used when the CPU reports them
+ */
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void float_to_s16_avx2(int16_t *dst, const void *src, size_t samples)
+{
+   const float *in = src;
+   const __m256 scale = _mm256_set1_ps(32768.0f);
+   const __m256 max = _mm256_set1_ps(32767.0f);
+   const __m256 min = _mm256_set1_ps(-32768.0f);
+   size_t i;
+
+   for ( i = 0; i + 16 <= samples; i += 16 )
+   {
+      __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+      __m256 b = _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale);
+      a = _mm256_max_ps(_mm256_min_ps(a, max), min);
+      b = _mm256_max_ps(_mm256_min_ps(b, max), min);
+      /* packs works per 128-bit lane, so put the quadwords back in order */
+      __m256i p = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+      _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(p, 0xd8));
+   }
+   float_to_s16_c(dst + i, in + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void s32_to_s16_avx2(int16_t *dst, const void *src, size_t samples)
+{
+   const int32_t *in = src;
+   size_t i;
+
+   for ( i = 0; i + 16 <= samples; i += 16 )
+   {
+      __m256i a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*)(in + i)), 16);
+      __m256i b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*)(in + i + 8)), 16);
+      __m256i p = _mm256_packs_epi32(a, b);
+      _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(p, 0xd8));
+   }
+   s32_to_s16_c(dst + i, in + i, samples - i);
+}
+
+/* Picks the upper two bytes of each 3-byte sample with byte shuffles.
+ * 8 samples are 24 bytes, read as two overlapping 16-byte loads: the first
+ * gives samples 0-2, the second (from byte 8) samples 3-7. Only needs
+ * SSSE3. */
+__attribute__((target("ssse3")))
+static void s24_3le_to_s16_ssse3(int16_t *dst, const void *src, size_t samples)
+{
+   const uint8_t *in = src;
+   const __m128i shuf_lo = _mm_setr_epi8(1, 2, 4, 5, 7, 8, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i shuf_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 3,
+                                         5, 6, 8, 9, 11, 12, 14, 15);
+   size_t i;
+
+   for ( i = 0; i + 8 <= samples; i += 8 )
+   {
+      __m128i a = _mm_loadu_si128((const __m128i*)(in + i * 3));
+      __m128i b = _mm_loadu_si128((const __m128i*)(in + i * 3 + 8));
+      _mm_storeu_si128((__m128i*)(dst + i),
+            _mm_or_si128(_mm_shuffle_epi8(a, shuf_lo), _mm_shuffle_epi8(b, shuf_hi)));
+   }
+   s24_3le_to_s16_c(dst + i, in + i * 3, samples - i);
+}
+#endif
+
+/*
+ * NEON
+ */
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void float_to_s16_neon(int16_t *dst, const void *src, size_t samples)
+{
+   const float *in = src;
+   const float32x4_t scale = vdupq_n_f32(32768.0f);
+   size_t i;
+
+   for ( i = 0; i + 8 <= samples; i += 8 )
+   {
+      float32x4_t a = vmulq_f32(vld1q_f32(in + i), scale);
+      float32x4_t b = vmulq_f32(vld1q_f32(in + i + 4), scale);
+      /* The float conversion saturates, vqmovn saturates again down to
+       * 16 bits. */
+#if defined(__aarch64__)
+      int16x4_t lo = vqmovn_s32(vcvtnq_s32_f32(a));
+      int16x4_t hi = vqmovn_s32(vcvtnq_s32_f32(b));
+#else
+      /* ARMv7 only truncates, so round by adding 0.5 with the sign of x */
+      const uint32x4_t sign = vdupq_n_u32(0x80000000);
+      const float32x4_t half = vdupq_n_f32(0.5f);
+      int16x4_t lo = vqmovn_s32(vcvtq_s32_f32(vaddq_f32(a, vbslq_f32(sign, a, half))));
+      int16x4_t hi = vqmovn_s32(vcvtq_s32_f32(vaddq_f32(b, vbslq_f32(sign, b, half))));
+#endif
+      vst1q_s16(dst + i, vcombine_s16(lo, hi));
+   }
+   float_to_s16_c(dst + i, in + i, samples - i);
+}
+
+static void s32_to_s16_neon(int16_t *dst, const void *src, size_t samples)
+{
+   const int32_t *in = src;
+   size_t i;
+
+   for ( i = 0; i + 8 <= samples; i += 8 )
+   {
+      int16x4_t lo = vshrn_n_s32(vld1q_s32(in + i), 16);
+      int16x4_t hi = vshrn_n_s32(vld1q_s32(in + i + 4), 16);
+      vst1q_s16(dst + i, vcombine_s16(lo, hi));
+   }
+   s32_to_s16_c(dst + i, in + i, samples - i);
+}
+
+static void s24_3le_to_s16_neon(int16_t *dst, const void *src, size_t samples)
+{
+   const uint8_t *in = src;
+   size_t i;
+
+   for ( i = 0; i + 16 <= samples; i += 16 )
+   {
+      uint8x16x3_t v = vld3q_u8(in + i * 3);
+      uint8x16x2_t out = { { v.val[1], v.val[2] } };
+      vst2q_u8((uint8_t*)(dst + i), out);
+   }
+   s24_3le_to_s16_c(dst + i, in + i * 3, samples - i);
+}
+#endif
+
+rsound_convert_t rsound_get_convert(snd_pcm_format_t format)
+{
+#ifdef HAVE_AVX2_KERNELS
+   int avx2 = __builtin_cpu_supports("avx2");
+   int ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+   switch ( format )
+   {
+      case SND_PCM_FORMAT_FLOAT_LE:
+#ifdef HAVE_AVX2_KERNELS
+         if ( avx2 )
+            return float_to_s16_avx2;
+#endif
+#if defined(__SSE2__)
+         return float_to_s16_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+         return float_to_s16_neon;
+#else
+         return float_to_s16_c;
+#endif
+
+      case SND_PCM_FORMAT_S32_LE:
+#ifdef HAVE_AVX2_KERNELS
+         if ( avx2 )
+            return s32_to_s16_avx2;
+#endif
+#if defined(__SSE2__)
+         return s32_to_s16_sse2;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+         return s32_to_s16_neon;
+#else
+         return s32_to_s16_c;
+#endif
+
+      case SND_PCM_FORMAT_S24_3LE:
+#ifdef HAVE_AVX2_KERNELS
+         if ( ssse3 )
+            return s24_3le_to_s16_ssse3;
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+         return s24_3le_to_s16_neon;
+#else
+         return s24_3le_to_s16_c;
+#endif
+
+      default:
+         return NULL;
+   }
+}
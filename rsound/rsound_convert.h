@@ -0,0 +1,33 @@
+/*
+ * ALSA <-> RSound PCM output plugin, sample format conversion
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __RSOUND_CONVERT_H
+#define __RSOUND_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/* Converts samples from an input format to native S16. */
+typedef void (*rsound_convert_t)(int16_t *dst, const void *src, size_t samples);
+
+/* Returns the fastest converter to S16 this CPU has for format, or NULL if
+ * the format isn't handled. */
+rsound_convert_t rsound_get_convert(snd_pcm_format_t format);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * ALSA <-> RSound PCM output plugin, drift correction resampler
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <string.h>
+#include "rsound_resample.h"
+
+void rsound_resampler_reset(rsound_resampler_t *rs, unsigned int channels)
+{
+   memset(rs, 0, sizeof(*rs));
+   rs->channels = channels;
+   /* Start exactly on the first input frame. */
+   rs->phase = 1ULL << 32;
+}
+
+size_t rsound_resample(rsound_resampler_t *rs, int16_t *out,
+      const int16_t *in, size_t in_frames, uint64_t step)
+{
+   unsigned int ch = rs->channels;
+   uint64_t end = (uint64_t)in_frames << 32;
+   uint64_t p = rs->phase;
+   size_t frames = 0;
+   unsigned int c;
+
+   if ( in_frames == 0 )
+      return 0;
+
+   /* The input is seen as prev followed by in, position 0 being prev.
+    * Each output frame lies between frames i and i + 1 of that sequence. */
+   while ( p < end )
+   {
+      size_t i = p >> 32;
+      int32_t frac = (int32_t)((p & 0xffffffffULL) >> 17); /* 15 bits */
+      const int16_t *a = i == 0 ? rs->prev : in + (i - 1) * ch;
+      const int16_t *b = in + i * ch;
+
+      for ( c = 0; c < ch; c++ )
+         out[c] = (int16_t)(a[c] + (((b[c] - a[c]) * frac) >> 15));
+
+      out += ch;
+      frames++;
+      p += step;
+   }
+
+   rs->phase = p - end;
+   memcpy(rs->prev, in + (in_frames - 1) * ch, ch * sizeof(int16_t));
+   return frames;
+}
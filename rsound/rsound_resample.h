@@ -0,0 +1,47 @@
+/*
+ * ALSA <-> RSound PCM output plugin, drift correction resampler
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __RSOUND_RESAMPLE_H
+#define __RSOUND_RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RSOUND_RESAMPLE_MAX_CHANNELS 8
+
+/* Largest correction in ppm. Output is at most in * (1 + 1/999) + 1 frames. */
+#define RSOUND_RESAMPLE_MAX_PPM 1000
+
+/* Linear interpolation on interleaved S16, for ratios within a few hundred
+ * ppm of 1. The last input frame is kept between calls, so a stream can be
+ * fed in arbitrary pieces. */
+typedef struct rsound_resampler
+{
+   unsigned int channels;
+   uint64_t phase; /* 32.32 position, relative to prev */
+   int16_t prev[RSOUND_RESAMPLE_MAX_CHANNELS];
+} rsound_resampler_t;
+
+void rsound_resampler_reset(rsound_resampler_t *rs, unsigned int channels);
+
+/* Resamples in_frames frames from in into out, advancing step (32.32) input
+ * frames per output frame. Returns the number of frames written. */
+size_t rsound_resample(rsound_resampler_t *rs, int16_t *out,
+      const int16_t *in, size_t in_frames, uint64_t step);
+
+#endif
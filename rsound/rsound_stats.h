@@ -0,0 +1,60 @@
+/*
+ * ALSA <-> RSound PCM output plugin, per-stream statistics
+ *
+ * The PCM keeps these counters for every stream. With the stats option they
+ * live in a POSIX shared memory segment named /alsa-rsound.<pid>.<n>, where
+ * the ctl_rsound plugin picks them up.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __RSOUND_STATS_H
+#define __RSOUND_STATS_H
+
+#include <stdint.h>
+
+#define RSOUND_STATS_MAGIC 0x53445352 /* "RSDS" */
+#define RSOUND_STATS_VERSION 1
+#define RSOUND_STATS_PREFIX "alsa-rsound."
+
+/* Bucket 0 counts rsd_write calls under 1 us, bucket n those taking
+ * 2^(n-1) to 2^n - 1 us. The last bucket takes everything longer. */
+#define RSOUND_STATS_BUCKETS 24
+
+struct rsound_stats
+{
+   uint32_t magic;
+   uint32_t version;
+   int32_t pid;
+   uint32_t reserved;
+
+   uint64_t bytes_sent;     /* stream bytes handed to librsound */
+   uint64_t short_writes;   /* rsd_write calls that took less than asked */
+   uint64_t write_failures; /* rsd_write calls that failed */
+   uint64_t restarts;       /* hosts put back into the stream after a drop */
+   uint64_t write_latency[RSOUND_STATS_BUCKETS];
+};
+
+/* There is a single writer, the thread driving the PCM. Relaxed atomics
+ * keep a reader in another process from seeing torn values without making
+ * the writer pay for locked instructions. */
+#define RSOUND_STATS_ADD(stats, field, n) \
+   __atomic_store_n(&(stats)->field, \
+         __atomic_load_n(&(stats)->field, __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+#define RSOUND_STATS_GET(stats, field) \
+   __atomic_load_n(&(stats)->field, __ATOMIC_RELAXED)
+
+#endif